@@ -0,0 +1,68 @@
+/**
+ * @file arena.h
+ * Region memory allocators API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Size of the memory blocks an arena takes from the heap */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct arena_block;
+
+/**
+ * A region allocator. Allocations are carved one after another from
+ * large blocks and are all freed at once with the arena.
+ * A zero-initialized arena is empty and ready for use.
+ */
+struct arena {
+	struct arena_block *head;	/**< The block being filled, or NULL */
+};
+
+/**
+ * A pool of strings stored one after another in a single buffer
+ * and referenced by 32-bit offsets, which stay valid when the pool
+ * grows. No string starts at offset 0, so it may mean "no string".
+ * A zero-initialized pool is empty and ready for use.
+ */
+struct str_pool {
+	char *buf;	/**< The strings */
+	size_t len;	/**< The amount of the buffer used */
+	size_t size;	/**< The allocated size */
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *s, size_t len);
+void arena_release(struct arena *a);
+uint32_t str_pool_add(struct str_pool *p, const char *s, size_t len);
+void str_pool_release(struct str_pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ARENA_H */
@@ -0,0 +1,79 @@
+/**
+ * @file bwlimit.h
+ * Bandwidth limiting API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __BWLIMIT_H
+#define __BWLIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Lowest bandwidth limit, slower transfers would look stalled */
+#define BW_MIN_RATE (16L * 1024)
+/** Time worth of data the bucket may hold, keeps the pace smooth */
+#define BW_BURST_MS 50
+/** Smallest bucket capacity */
+#define BW_MIN_BURST (16 * 1024)
+
+enum bw_dir {
+	BW_DOWN,	/**< Downloaded data */
+	BW_UP,		/**< Uploaded data */
+	BW_NR_DIRS
+};
+
+/**
+ * A token bucket of one transfer direction.
+ */
+struct bw_bucket {
+	long rate;		/**< Bytes per second, 0 for no limit */
+	double tokens;		/**< Available bytes, negative when owed */
+	int64_t last_ns;	/**< Time of the last refill */
+};
+
+/**
+ * A bandwidth limit shared by all transfers of a session.
+ * Each transfer callback reserves the bytes it passes. A transfer
+ * run alone sleeps until the reservation is covered. The transfers
+ * run together by a multi handle are paused instead, and the loop
+ * running them resumes each one when the bucket is out of debt, so
+ * they share the rate without blocking one another.
+ */
+struct bw_limit {
+	pthread_mutex_t lock;			/**< Protects the buckets */
+	struct bw_bucket buckets[BW_NR_DIRS];	/**< The buckets */
+};
+
+void bw_limit_init(struct bw_limit *bw);
+void bw_limit_cleanup(struct bw_limit *bw);
+void bw_limit_set(struct bw_limit *bw, enum bw_dir dir, long rate);
+size_t bw_limit_chunk(struct bw_limit *bw, enum bw_dir dir, size_t size);
+void bw_limit_take(struct bw_limit *bw, enum bw_dir dir, size_t bytes);
+int64_t bw_limit_pause(struct bw_limit *bw, enum bw_dir dir, size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BWLIMIT_H */
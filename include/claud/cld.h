@@ -26,22 +26,63 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
 #include <claud/types.h>
 
 struct CURL;
 struct interface;
 struct file_list;
+struct conn_pool;
+struct hedge;
+struct cld_thread;
+struct warmup;
+struct shard_set;
+struct session;
+struct xfer;
+struct bw_limit;
+struct mem_budget;
+
+/**
+ * Called by cld_iterate_file_list() with each directory entry.
+ * @param arg - the callback argument;
+ * @param finfo - the listing holding the strings of the entry, valid
+ * only during the call;
+ * @param li - the entry.
+ * @return 0 to continue, or nonzero to stop the listing.
+ */
+typedef int (*cld_list_iter)(void *arg, const struct file_list *finfo,
+			     const struct list_item *li);
 
 /**
  * MailRuCloud holds all information which required for the api operations.
+ *
+ * A session may be used by several threads at once. Each thread makes
+ * its requests with its own CURL handle and connections, sharing
+ * the cookies of the session, and should call cld_thread_release()
+ * before exiting. The settings may be changed at any time. Transfers
+ * started with cld_get_files() and cld_upload_files() by different
+ * threads are run one after another, as they share the concurrency
+ * limit of the session. new_cloud() and delete_cloud() must not run
+ * concurrently with other calls on the session.
  */
 struct cld {
-	struct CURL *curl;
+	struct CURL *curl;		/**< The handle logging in, under lock */
+	struct conn_pool *pool;
+	struct hedge *hedge;
+	pthread_mutex_t lock;		/**< Guards the session and the token */
+	pthread_mutex_t shards_lock;	/**< Serializes the shard refresh */
+	pthread_key_t thread_key;	/**< The state of the calling thread */
+	struct cld_thread *threads;	/**< The states of all threads */
+	struct warmup *warmup;
+	struct session *session;
 	char *auth_token;
-	struct {
-		char *get;
-		char *upload;
-	} shard;
+	struct shard_set *shards;
+	struct xfer *xfer;
+	struct bw_limit *bw;
+	struct mem_budget *budget;
+	long stall_speed;
+	long stall_time;
+	bool adaptive_buffers;
 	void (*io_progress)(int64_t, struct interface *interface);
 	struct interface *(*init_io_progress)(int64_t);
 };
@@ -51,20 +92,34 @@ struct cld *new_cloud(const char *user,
 				const char *domain,
 				int *error);
 void delete_cloud(struct cld *c);
+void cld_thread_release(struct cld *c);
 
 int cld_get_shard_info(struct cld *c);
+int cld_set_hedging(struct cld *c, bool enabled, int percentile, int budget);
+int cld_set_stall_limits(struct cld *c, long min_speed, long window);
+void cld_set_adaptive_buffers(struct cld *c, bool enabled);
+int cld_set_bandwidth_limit(struct cld *c, long down, long up);
+int cld_set_memory_budget(struct cld *c, size_t size);
+int cld_set_max_concurrency(struct cld *c, int max);
+void cld_get_stats(struct cld *c, struct transfer_stats *stats);
 
 int cld_mkdir(struct cld *c, const char *path);
 int cld_remove(struct cld *c, const char *path);
 int cld_move(struct cld *c, const char *src, const char *dst);
 int cld_copy(struct cld *c, const char *src, const char *dst);
 int cld_get(struct cld *c, const char *src, const char *dst);
+int cld_get_files(struct cld *c, const char *const src[],
+		  const char *const dst[], size_t nr_files);
 int cld_get_part(struct cld *c, int fd, const char *src);
 int cld_upload(struct cld *c, const char *src, const char *dst);
+int cld_upload_files(struct cld *c, const char *const src[],
+		     const char *const dst[], size_t nr_files);
 int cld_file_stat(struct cld *c, const char *path, struct file_list *finfo);
 void cld_file_list_cleanup(struct file_list *finfo);
 int cld_get_file_list(struct cld *c, const char *path, struct file_list *finfo,
 		      bool raw);
+int cld_iterate_file_list(struct cld *c, const char *path, bool raw,
+			  cld_list_iter iter, void *arg);
 int cld_share(struct cld *c, const char *path, char **link);
 int cld_count_parts(struct cld *c, const char *path);
 int cld_df(struct cld *c, struct space_info *info);
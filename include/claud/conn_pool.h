@@ -0,0 +1,77 @@
+/**
+ * @file conn_pool.h
+ * Connection pool API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __CONN_POOL_H
+#define __CONN_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of extra CURL handles kept by the pool */
+#define CONN_POOL_SIZE 16
+/** Number of handles bulk transfers can never take */
+#define CONN_POOL_RESERVED 2
+/** Maximum number of handles used by bulk transfers */
+#define CONN_POOL_MAX_BULK (CONN_POOL_SIZE - CONN_POOL_RESERVED)
+
+/**
+ * Classes of requests made over pooled handles. Metadata requests
+ * are small and latency sensitive, so a few handles are reserved
+ * for them and bulk transfers cannot starve them.
+ */
+enum conn_class {
+	CONN_METADATA,	/**< API calls, probes and hedges */
+	CONN_BULK	/**< File data transfers */
+};
+
+/**
+ * A pool of CURL easy handles sharing cookies, DNS cache and
+ * TLS sessions. The shared data is protected with locks, so handles
+ * may be used from different threads, and handles may be taken and
+ * returned by any thread. Live connections are not shared, they stay
+ * with the handle, or with the multi handle, that made them.
+ */
+struct conn_pool {
+	CURLSH *share;				/**< The shared data handle */
+	CURL *handles[CONN_POOL_SIZE];		/**< Lazily created handles */
+	bool busy[CONN_POOL_SIZE];		/**< Whether a handle is in use */
+	bool bulk[CONN_POOL_SIZE];		/**< Whether it is used for bulk */
+	int nr_bulk;				/**< Handles used for bulk */
+	pthread_mutex_t lock;			/**< Guards the handle slots */
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST]; /**< Shared data locks */
+};
+
+int conn_pool_init(struct conn_pool *pool);
+void conn_pool_cleanup(struct conn_pool *pool);
+void conn_pool_attach(struct conn_pool *pool, CURL *curl);
+CURL *conn_pool_acquire(struct conn_pool *pool, enum conn_class cls);
+void conn_pool_release(struct conn_pool *pool, CURL *curl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONN_POOL_H */
@@ -0,0 +1,76 @@
+/**
+ * @file hedge.h
+ * Hedged requests API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __HEDGE_H
+#define __HEDGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of latency samples the hedging delay is computed from */
+#define HEDGE_WINDOW 64
+/** Samples needed before the percentile delay is trusted */
+#define HEDGE_MIN_SAMPLES 8
+/** Hedging delay used until enough samples are collected */
+#define HEDGE_DEFAULT_DELAY_MS 1000
+/** Lower bound of the hedging delay */
+#define HEDGE_MIN_DELAY_MS 20
+#define HEDGE_DEFAULT_PERCENTILE 95
+/** Default hedges allowed per 100 requests */
+#define HEDGE_DEFAULT_BUDGET 5
+/** Number of unused hedges that may be saved up */
+#define HEDGE_MAX_BURST 2
+
+struct cld;
+struct memory_struct;
+
+/**
+ * Hedging policy and statistics of a cloud session, shared by
+ * its threads.
+ */
+struct hedge {
+	pthread_mutex_t lock;		/**< Guards the fields below */
+	bool enabled;			/**< Whether hedging is enabled */
+	int percentile;			/**< Latency percentile used as delay */
+	int budget;			/**< Hedges allowed per 100 requests */
+	long latency[HEDGE_WINDOW];	/**< Recent latencies, ms */
+	size_t nr_samples;		/**< Number of valid samples */
+	size_t next;			/**< Next sample slot */
+	long credit;			/**< Budget credit, 100 per hedge */
+	unsigned long nr_requests;	/**< Number of hedgeable requests */
+	unsigned long nr_hedges;	/**< Number of hedges sent */
+};
+
+void hedge_init(struct hedge *h);
+void hedge_cleanup(struct hedge *h);
+int hedged_get_req(struct cld *c, struct memory_struct *chunk,
+		   const char *url);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HEDGE_H */
@@ -23,12 +23,16 @@
 #define __HTTP_API
 
 #include <stdbool.h>
+#include <claud/utils.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* May be set at build time to run against a local server */
+#ifndef CLOUD_ENDPOINT
 #define CLOUD_ENDPOINT "https://cloud.mail.ru/"
+#endif
 #define URL_BASE CLOUD_ENDPOINT "api/v2/"
 #define PUBLIC_ENDPOINT CLOUD_ENDPOINT "public/"
 #define USER_AGENT "Mozilla / 5.0(Windows; U; Windows NT 5.1; en - US; rv: 1.9.0.1) Gecko / 2008070208 Firefox / 3.0.1"
@@ -36,6 +40,13 @@ extern "C" {
 /* 128K buffer */
 #define UPLOAD_BUFFERSIZE (1L << 17)
 #define DOWNLOAD_BUFFERSIZE (1L << 17)
+/** Sent data of a mapped upload is dropped from memory in steps of this size */
+#define UPLOAD_DROP_STEP (1L << 20)
+
+/* A transfer slower than 1K/s for 30 seconds is considered stalled */
+#define STALL_SPEED_LIMIT 1024L
+#define STALL_TIME 30L
+#define CONNECT_TIMEOUT 30L
 
 /**
  * The mail.ru file size limit for a free account is 2GB.
@@ -53,6 +64,28 @@ extern "C" {
 #define PART_REGEX "(.+)(\\" PART_SUFFIX ")([[:digit:]]+)"
 
 struct CURL;
+struct bw_limit;
+
+/**
+ * A reusable request builder. The URL with its query and the form
+ * fields are URL-encoded directly into growable buffers.
+ */
+struct request {
+	struct strbuf url;	/**< The request URL */
+	struct strbuf fields;	/**< The URL-encoded form fields */
+};
+
+/**
+ * A consumer of the response body processing it while it arrives,
+ * instead of collecting it in memory.
+ */
+struct response_sink {
+	/** Called before each request attempt, to drop a previous response */
+	void (*start)(void *arg);
+	/** Consume the next piece of the body, return 0 for success */
+	int (*write)(void *arg, const char *data, size_t size);
+	void *arg;	/**< The callback argument */
+};
 
 /**
  * A memory structure receiving the HTTP response.
@@ -61,7 +94,17 @@ struct memory_struct {
 	char *memory;		/**< The memory buffer pointer */
 	size_t size;		/**< The memory buffer size */
 	size_t buf_size; 	/**< Upload or download buffer size */
+	size_t sock_buf_size;	/**< Socket buffer size of new connections, 0 for the default */
+	long code;		/**< The HTTP response code of the last request */
+	long stall_speed;	/**< Minimum speed in bytes per second, 0 to not detect stalls */
+	long stall_time;	/**< Seconds the speed may stay below the minimum */
 	bool show_progress;	/**< Whether to show progress while uploading or downloading files */
+	bool resume;		/**< Whether to continue a partial download into the memory */
+	bool compressed;	/**< Whether to accept a gzip or deflate encoded response */
+	struct bw_limit *bw;	/**< Bandwidth limit of file data, or NULL */
+	bool bw_pause;		/**< Pause instead of sleeping when over the limit */
+	int64_t bw_resume;	/**< Time to resume the paused transfer at, ms, or 0 */
+	struct response_sink *sink;	/**< Consumer of the body, or NULL to keep it in the memory */
 };
 
 /**
@@ -71,6 +114,20 @@ struct upload_stream {
 	FILE *f;	/**< The file descriptor used with file I/O API */
 	void *addr;	/**< The memory pointer used when data is uploaded from memory */
 	size_t left;	/**< The amount of data left to be uploaded */
+	struct bw_limit *bw;	/**< Bandwidth limit, or NULL */
+	bool bw_pause;		/**< Pause instead of sleeping when over the limit */
+	int64_t bw_resume;	/**< Time to resume the paused transfer at, ms, or 0 */
+	void *base;	/**< Page aligned start of mapped data to drop once sent, or NULL */
+	size_t dropped;	/**< The amount of mapped data dropped */
+};
+
+/**
+ * The multipart form of a file upload request
+ */
+struct upload_form {
+	struct curl_httppost *formpost;	/**< The form */
+	struct curl_slist *headers;	/**< Extra request headers */
+	char *filename;			/**< The uploaded file name */
 };
 
 /**
@@ -96,8 +153,15 @@ void memory_struct_init(struct memory_struct *mem);
 void memory_struct_cleanup(struct memory_struct *mem);
 void memory_struct_reset(struct memory_struct *mem);
 
+size_t http_req_buffers(const struct memory_struct *chunk, bool upload);
+void http_req_setup(CURL *curl, struct memory_struct *chunk, const char *url,
+		    struct progress_data *progress_data);
+int http_req_result(CURL *curl, struct memory_struct *chunk, CURLcode res);
 int http_req(CURL *curl, struct memory_struct *chunk, const char *url);
 int get_req(CURL *curl, struct memory_struct *chunk, const char *url);
+int get_req_hedged(CURLM *multi, CURL *curl, CURL *backup,
+		   struct memory_struct *chunk, const char *url,
+		   long delay_ms, bool *hedged);
 int post_form_req(CURL *curl,
 	     struct memory_struct *chunk,
 	     const char *url,
@@ -106,23 +170,29 @@ int post_form_req(CURL *curl,
 	     size_t nr_params);
 int post_req(CURL *curl,
 	     struct memory_struct *chunk,
-	     const char *url,
-	     const char *names[],
-	     const char *values[],
-	     size_t nr_params);
-
+	     const struct request *req);
+
+int upload_req_setup(CURL *curl,
+		     struct memory_struct *chunk,
+		     const char *url,
+		     const char *dst,
+		     struct upload_stream *upst,
+		     struct upload_form *form,
+		     struct progress_data *progress_data);
+void upload_form_cleanup(struct upload_form *form);
 int upload_req(CURL *curl,
 	       struct memory_struct *chunk,
 	       const char *url,
 	       const char *dst,
 	       struct upload_stream *upst);
 
-char *make_url(const char *s);
-char *make_url_with_params(struct CURL *curl,
-			   const char *s,
-			   const char *names[],
-			   const char *values[],
-			   size_t nr_params);
+void request_init(struct request *req);
+void request_cleanup(struct request *req);
+void request_url(struct request *req, const char *base, const char *route);
+int request_add_params(struct request *req, const char *names[],
+		       const char *values[], size_t nr_params);
+int request_add_fields(struct request *req, const char *names[],
+		       const char *values[], size_t nr_params);
 
 #ifdef __cplusplus
 }
@@ -3,6 +3,13 @@
 
 #include <stddef.h>
 
+/*
+ * Parent links let a closing bracket find its container without
+ * scanning back over all the tokens parsed so far. The token layout
+ * depends on it, so it is set here for every user of the header.
+ */
+#define JSMN_PARENT_LINKS
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,12 +43,14 @@ enum jsmnerr {
  * type		type (object, array, string etc.)
  * start	start position in JSON data string
  * end		end position in JSON data string
+ * span		number of tokens in the subtree, the token itself included
  */
 typedef struct {
 	jsmntype_t type;
 	int start;
 	int end;
 	int size;
+	int span;
 #ifdef JSMN_PARENT_LINKS
 	int parent;
 #endif
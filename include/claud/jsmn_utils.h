@@ -22,7 +22,68 @@
 #ifndef __JSMN_UTILS_H
 #define __JSMN_UTILS_H
 
+#include <stdbool.h>
 #include <claud/jsmn.h>
+#include <claud/arena.h>
+
+/** Token storage up to this number of tokens is kept for reuse */
+#define JSON_POOL_KEEP (64 * 1024)
+/** Maximum number of fields decoded from an object at once */
+#define JSON_FIELDS_MAX 16
+
+/**
+ * Hash table of the names of the fields decoded from JSON objects,
+ * so that each key of an object is matched in constant time.
+ */
+struct json_fields {
+	const char *const *names;		/**< The field names */
+	size_t nr_names;			/**< The number of names */
+	unsigned char slots[2 * JSON_FIELDS_MAX]; /**< Name index + 1, or 0 */
+};
+
+/**
+ * Types of the values decoded by json_decode_object().
+ */
+enum json_field_type {
+	JSON_INT,	/**< A number stored to an int */
+	JSON_INT64,	/**< A number stored to an int64_t */
+	JSON_TIME,	/**< A number of seconds stored to a time_t */
+	JSON_BOOL,	/**< true or false stored to a bool */
+	JSON_STRING,	/**< A string copied to an allocated char * */
+	JSON_OBJECT,	/**< An object whose fields go to the same struct */
+	JSON_CUSTOM	/**< A value decoded by the field callback */
+};
+
+/**
+ * Descriptor of a field decoded from a JSON object to a member
+ * of a struct.
+ */
+struct json_field {
+	const char *name;		/**< The key */
+	enum json_field_type type;	/**< The value type */
+	size_t offset;			/**< Offset of the member in the struct */
+	bool required;			/**< Decoding fails without the field */
+	const struct json_field *fields; /**< The fields of a JSON_OBJECT */
+	size_t nr_fields;		/**< The number of the object fields */
+	/**
+	 * Decode a JSON_CUSTOM value.
+	 * @param js - the JSON code;
+	 * @param t - the value token;
+	 * @param member - the struct member;
+	 * @param ctx - the context passed to json_decode_object().
+	 * @return 0 for success, or 1 for error.
+	 */
+	int (*decode)(const char *js, jsmntok_t *t, void *member, void *ctx);
+};
+
+/**
+ * Decoder of JSON objects to structs described by a field table.
+ */
+struct json_decoder {
+	const struct json_field *fields;	/**< The field table */
+	const char *names[JSON_FIELDS_MAX];	/**< The keys of the fields */
+	struct json_fields index;		/**< The index of the keys */
+};
 
 #ifdef __cplusplus
 }
@@ -33,8 +94,19 @@ jsmntok_t *find_json_element_by_name(const char *js, jsmntok_t *t,
 		 size_t count, jsmntype_t type, const char *name);
 int64_t parse_json_int64(const char *js, jsmntok_t *t);
 char *parse_json_string(const char *js, jsmntok_t *t);
+char *parse_json_arena_string(const char *js, jsmntok_t *t, struct arena *a);
 jsmntok_t *parse_json(jsmn_parser *p, const char *buf, size_t buf_size,
 		      size_t *count);
+void json_tokens_release(jsmntok_t *tok);
+int json_fields_init(struct json_fields *f, const char *const names[],
+		     size_t nr_names);
+size_t json_object_fields(const char *js, jsmntok_t *obj,
+			  const struct json_fields *f, jsmntok_t *values[]);
+jsmntok_t *json_typed(jsmntok_t *t, jsmntype_t type);
+int json_decoder_init(struct json_decoder *d, const struct json_field fields[],
+		      size_t nr_fields);
+int json_decode_object(const char *js, jsmntok_t *obj,
+		       const struct json_decoder *d, void *dst, void *ctx);
 int64_t get_json_int64_by_name(const char *js, jsmntok_t *t,
 			       size_t count, const char *name);
 int get_json_int_by_name(const char *js, jsmntok_t *t,
@@ -0,0 +1,78 @@
+/**
+ * @file json_stream.h
+ * Incremental JSON array splitter API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __JSON_STREAM_H
+#define __JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <claud/utils.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Called with the JSON code of each object element of the array.
+ * @return 0 to continue, or nonzero to abort the stream.
+ */
+typedef int (*json_element_cb)(void *arg, const char *js, size_t len);
+
+/**
+ * A push parser which is fed a JSON document in pieces of any size
+ * and passes each object element of the array found at the specified
+ * path of object keys to a callback as soon as the element is complete.
+ * Only the element being received is buffered, the rest of the document
+ * is scanned and dropped.
+ */
+struct json_stream {
+	const char *const *path;	/**< The keys leading to the array */
+	size_t nr_path;			/**< The number of keys */
+	json_element_cb on_element;	/**< The element callback */
+	void *arg;			/**< The callback argument */
+	struct strbuf elem;		/**< The element received so far */
+	size_t depth;			/**< The number of open containers */
+	size_t matched;			/**< Open containers on the path */
+	size_t key_pos;			/**< Position in the key being matched */
+	bool in_string;			/**< Inside a string */
+	bool escape;			/**< After a backslash in a string */
+	bool in_key;			/**< The string is a key on the path */
+	bool key_match;			/**< The key matches so far */
+	bool key_hit;			/**< The last key is on the path */
+	bool expect_key;		/**< The next string is a key */
+	bool in_elem;			/**< An element is being received */
+	bool found;			/**< The array has been found */
+	bool failed;			/**< The stream was aborted */
+};
+
+void json_stream_init(struct json_stream *s, const char *const path[],
+		      size_t nr_path, json_element_cb on_element, void *arg);
+void json_stream_reset(struct json_stream *s);
+void json_stream_cleanup(struct json_stream *s);
+int json_stream_feed(struct json_stream *s, const char *data, size_t len);
+int json_stream_finish(struct json_stream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JSON_STREAM_H */
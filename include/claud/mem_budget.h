@@ -0,0 +1,75 @@
+/**
+ * @file mem_budget.h
+ * Transfer memory budget API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __MEM_BUDGET_H
+#define __MEM_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Memory each parallel transfer may take with the default budget.
+ * It holds the largest adaptive libcurl buffers, but not the largest
+ * socket buffers, so transfers with large socket buffers run fewer
+ * at once.
+ */
+#define MEM_BUDGET_PER_TRANSFER (4UL << 20)
+/** Upper bound of the default memory budget */
+#define MEM_BUDGET_DEFAULT_MAX (64UL << 20)
+/** Smallest memory budget accepted */
+#define MEM_BUDGET_MIN (1UL << 20)
+
+/**
+ * The memory the buffers of running transfers may take. A transfer
+ * reserves its buffers before it starts and releases them when it
+ * is over. A reservation always succeeds when nothing is reserved,
+ * so that a single transfer larger than the budget still runs.
+ */
+struct mem_budget {
+	pthread_mutex_t lock;	/**< Protects the counters */
+	pthread_cond_t freed;	/**< Signalled when memory is released */
+	size_t limit;		/**< The budget */
+	bool fixed;		/**< Whether the budget was set explicitly */
+	size_t used;		/**< The reserved memory */
+	size_t peak;		/**< The highest reservation seen */
+};
+
+void mem_budget_init(struct mem_budget *b, size_t limit);
+void mem_budget_cleanup(struct mem_budget *b);
+void mem_budget_set_limit(struct mem_budget *b, size_t limit);
+size_t mem_budget_default(int max_concurrency);
+void mem_budget_set_default(struct mem_budget *b, size_t limit);
+bool mem_budget_try(struct mem_budget *b, size_t size);
+void mem_budget_acquire(struct mem_budget *b, size_t size);
+void mem_budget_charge(struct mem_budget *b, size_t size);
+void mem_budget_release(struct mem_budget *b, size_t size);
+size_t mem_budget_peak(struct mem_budget *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MEM_BUDGET_H */
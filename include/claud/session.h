@@ -0,0 +1,73 @@
+/**
+ * @file session.h
+ * Session cache and authenticated requests API for Mail.Ru Cloud
+ * access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <stdbool.h>
+#include <claud/http_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Directory of the session cache under the user cache directory */
+#define SESSION_CACHE_DIR "claud"
+#define SESSION_COOKIE_SUFFIX ".cookies"
+#define SESSION_TOKEN_SUFFIX ".token"
+#define SESSION_TLS_SUFFIX ".tls"
+/** Maximum length of a cached token */
+#define SESSION_MAX_TOKEN 256
+/** Maximum size of a cached TLS session */
+#define SESSION_MAX_TLS_RECORD (64 * 1024)
+
+struct cld;
+
+/**
+ * Credentials of the session and the files it is cached in.
+ * The cache files are only accessible by the user.
+ */
+struct session {
+	char *user;		/**< The user name */
+	char *password;		/**< The password, kept to log in again */
+	char *domain;		/**< The user domain */
+	char *cookie_file;	/**< The cookie cache, or NULL if not cached */
+	char *token_file;	/**< The token cache, or NULL if not cached */
+	char *tls_file;		/**< The TLS session cache, or NULL */
+};
+
+void session_init(struct session *s, const char *user, const char *password,
+		  const char *domain);
+void session_cleanup(struct session *s);
+int session_restore(struct cld *c);
+void session_save(struct cld *c);
+int session_refresh_token(struct cld *c);
+int session_login(struct cld *c);
+
+int api_get_req(struct cld *c, struct memory_struct *chunk);
+int api_post_req(struct cld *c, struct memory_struct *chunk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SESSION_H */
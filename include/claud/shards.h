@@ -0,0 +1,115 @@
+/**
+ * @file shards.h
+ * Shard info API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __SHARDS_H
+#define __SHARDS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Weight of a new sample in the moving averages, percent */
+#define SHARD_EWMA_WEIGHT 30
+/** Transfers smaller than this do not update the throughput estimate */
+#define SHARD_MIN_SPEED_SAMPLE (64L << 10)
+/** Reference transfer size used to compare shards */
+#define SHARD_REF_SIZE (1L << 20)
+/** Time a failed shard is avoided for, doubled on each further error */
+#define SHARD_PENALTY_MS 2000
+/** Maximum number of shards tried for a single transfer */
+#define SHARD_MAX_ATTEMPTS 3
+/** Time the dispatcher response is cached for */
+#define SHARD_CACHE_TTL_MS (10 * 60 * 1000L)
+/** Limits of the transfer buffers sized from the bandwidth-delay product */
+#define SHARD_MIN_BUFFER (16L << 10)
+#define SHARD_MAX_BUFFER (2L << 20)
+/** Socket buffers are only set above the range the kernel autotunes */
+#define SHARD_MIN_SOCK_BUFFER (4L << 20)
+#define SHARD_MAX_SOCK_BUFFER (64L << 20)
+/** shard_end() result of a transfer cancelled by the client */
+#define SHARD_CANCELLED (-1)
+
+struct request;
+struct memory_struct;
+struct shard_set;
+
+/**
+ * A shard with its measured performance.
+ */
+struct shard {
+	char *url;		/**< The shard URL */
+	long rtt_us;		/**< Connection round-trip time average */
+	double speed;		/**< Throughput average, bytes per second */
+	int inflight;		/**< Number of running transfers */
+	int nr_errors;		/**< Number of consecutive errors */
+	int64_t penalty_until;	/**< The shard is avoided until this time */
+	struct shard_set *set;	/**< The set the shard belongs to */
+	bool retired;		/**< No longer listed by the dispatcher */
+};
+
+/**
+ * A list of interchangeable shards.
+ */
+struct shard_list {
+	struct shard **items;	/**< The shards */
+	size_t size;		/**< The number of shards */
+};
+
+/**
+ * All shards known to a cloud session. The shards are shared by
+ * the threads of the session and guarded by the lock of the set.
+ * A shard the dispatcher no longer lists stays allocated until
+ * the last transfer running on it ends.
+ */
+struct shard_set {
+	pthread_mutex_t lock;		/**< Guards the lists and the statistics */
+	struct shard_list get;		/**< Download shards */
+	struct shard_list upload;	/**< Upload shards */
+	struct shard_list retired;	/**< Shards still used by transfers */
+	int64_t expires;		/**< The set must be refreshed after this time */
+};
+
+int shard_info_request(struct request *req, const char *token);
+int shard_info_parse(struct memory_struct *chunk, struct shard_info *s);
+void shard_info_cleanup(struct shard_info *s);
+
+void shard_set_init(struct shard_set *set);
+void shard_set_cleanup(struct shard_set *set);
+void shard_set_update(struct shard_set *set, struct shard_info *s);
+bool shard_set_valid(struct shard_set *set);
+void shard_set_invalidate(struct shard_set *set);
+void shard_set_probe(struct shard_set *set, const char *host_url,
+		     long rtt_us);
+struct shard *shard_select(struct shard_set *set, struct shard_list *list);
+int shard_end(struct shard *sh, CURL *curl, int res);
+void shard_buffer_sizes(struct shard *sh, size_t *buf_size,
+			size_t *sock_buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHARDS_H */
@@ -0,0 +1,57 @@
+/**
+ * @file thread.h
+ * Per-thread state API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __THREAD_H
+#define __THREAD_H
+
+#include <curl/curl.h>
+#include <claud/http_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cld;
+
+/**
+ * The state a thread needs to make requests of a cloud session.
+ * It is created on the first request of the thread and kept until
+ * the thread releases it or the session is deleted.
+ */
+struct cld_thread {
+	CURL *curl;			/**< The handle, shares the pool data */
+	CURLM *multi;			/**< Runs the hedged requests and
+					     keeps their connections */
+	struct request req;		/**< The request builder */
+	struct cld_thread *next;	/**< The next thread of the session */
+};
+
+int cld_threads_init(struct cld *c);
+void cld_threads_cleanup(struct cld *c);
+CURL *cld_curl(struct cld *c);
+CURLM *cld_multi(struct cld *c);
+struct request *cld_req(struct cld *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __THREAD_H */
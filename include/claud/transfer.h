@@ -0,0 +1,149 @@
+/**
+ * @file transfer.h
+ * Parallel transfer engine API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __TRANSFER_H
+#define __TRANSFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Size of the ranged segments a download is split into */
+#define XFER_SEGMENT_SIZE (8L << 20)
+/** Default upper bound of the concurrency level */
+#define XFER_DEFAULT_MAX_CONCURRENCY 8
+/** Concurrency level a session starts with */
+#define XFER_START_CONCURRENCY 2
+/** Throughput is measured over windows of this length */
+#define AIMD_WINDOW_MS 1000
+/** Minimum throughput gain in percent that allows one more transfer */
+#define AIMD_MIN_GAIN 5
+/** Percentage of the concurrency level kept after a cut */
+#define AIMD_DECREASE 50
+/** A latency above this percentage of the baseline is a spike */
+#define AIMD_LATENCY_SPIKE 300
+/** Latencies below this are never considered spikes */
+#define AIMD_MIN_SPIKE_MS 200
+/** Number of throttling responses tolerated for a single job */
+#define XFER_MAX_THROTTLED 8
+
+/** Longest wait for the running transfers, ms */
+#define XFER_POLL_MS 100
+
+/** xfer_run() result when the server does not support ranges */
+#define XFER_NO_RANGES 2
+
+struct cld;
+struct shard;
+
+/**
+ * Additive increase, multiplicative decrease controller
+ * of the number of parallel transfers.
+ */
+struct aimd {
+	int level;		/**< The current concurrency level */
+	int max;		/**< The upper bound of the level */
+	int64_t window_start;	/**< Start of the measuring window */
+	uint64_t window_bytes;	/**< Bytes transferred in the window */
+	double rate;		/**< Throughput of the last window */
+	double prev_rate;	/**< Throughput before the last increase */
+	long base_latency;	/**< Lowest time to the first byte, ms */
+	int64_t last_cut;	/**< Time of the last decrease */
+};
+
+/**
+ * The transfer engine state kept for the whole session. The engine
+ * runs the transfers of one thread at a time, the controller and
+ * the statistics may be accessed by other threads meanwhile.
+ */
+struct xfer {
+	pthread_mutex_t run_lock;	/**< Serializes the engine runs */
+	CURLM *multi;			/**< Keeps connections between runs */
+	pthread_mutex_t lock;		/**< Guards the fields below */
+	struct aimd aimd;		/**< The concurrency controller */
+	struct transfer_stats stats;	/**< The transfer statistics */
+};
+
+enum xfer_kind {
+	XFER_GET,	/**< Download a range of a remote file */
+	XFER_PUT	/**< Upload a file part */
+};
+
+enum xfer_state {
+	XFER_PENDING = 0,
+	XFER_RUNNING,
+	XFER_DONE,
+	XFER_FAILED
+};
+
+/**
+ * A single transfer run by the engine. The jobs of a file form
+ * a flow; flows share the running transfers fairly and the flows
+ * with the fewest bytes left are served first.
+ */
+struct xfer_job {
+	enum xfer_kind kind;		/**< The transfer type */
+	enum xfer_state state;		/**< The job state */
+	const char *path;		/**< The remote file path */
+	int flow;			/**< The file of a batch the job is for */
+	int fd;				/**< The local file to write (GET) */
+	off_t local_offset;		/**< Position in the local file (GET) */
+	off_t remote_offset;		/**< Position in the remote file (GET) */
+	size_t length;			/**< The number of bytes to transfer */
+	size_t done;			/**< Bytes confirmed (GET) */
+	size_t resumed_at;		/**< Bytes confirmed before the attempt */
+	void *addr;			/**< The data to upload (PUT) */
+	struct memory_struct chunk;	/**< Response and request options */
+	int nr_failures;		/**< Failed attempts without progress */
+	int nr_throttled;		/**< Throttling responses received */
+	/** Called as soon as the job is done, e.g. to register the file */
+	int (*on_done)(struct cld *c, struct xfer_job *job);
+	/* State of the running attempt */
+	CURL *curl;			/**< The handle, NULL if not running */
+	struct shard *shard;		/**< The shard used */
+	curl_off_t counted;		/**< Bytes accounted to the engine */
+	size_t reserved;		/**< Memory reserved for the buffers */
+	bool bad_range;			/**< The server ignored the range */
+	char range[48];			/**< The requested range (GET) */
+	struct upload_stream upst;	/**< The upload stream (PUT) */
+	struct upload_form form;	/**< The upload form (PUT) */
+};
+
+void xfer_init(struct xfer *x);
+void xfer_cleanup(struct xfer *x);
+void xfer_job_init(struct xfer_job *job, enum xfer_kind kind,
+		   const char *path);
+void xfer_job_cleanup(struct xfer_job *job);
+int xfer_run(struct cld *c, struct xfer_job *jobs, size_t nr_jobs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRANSFER_H */
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <claud/arena.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +43,15 @@ struct auth_token {
 
 struct list_item;
 
+/**
+ * Kinds of the cloud entries.
+ */
+enum item_kind {
+	KIND_UNKNOWN = 0,	/**< Not reported or not known */
+	KIND_FILE,		/**< A file */
+	KIND_FOLDER		/**< A directory */
+};
+
 /**
  * Struct file_list used to unmarshal json information about files in mail.ru cloud.
  */
@@ -61,7 +71,7 @@ struct file_list {
 			char *order;
 			char *type;
 		} sort;
-		char *kind;
+		enum item_kind kind;
 		int rev;
 		char *type;
 		char *home;
@@ -69,27 +79,22 @@ struct file_list {
 		struct list_item *list;
 		size_t nr_list_items;
 	} body;
+	struct arena arena;	/* Holds the strings of the body */
+	struct str_pool pool;	/* Holds the strings of the list items */
 };
 
 /**
  * Struct list_item used to unmarshal json information about a file.
+ * The fields used to scan and sort listings come first, the strings
+ * are kept in the string pool of the file_list.
  */
 struct list_item {
-	char *name;
-	int64_t size;
-	char *kind;
-	char *type;
-	char *home;
-	char *hash;
-	char *tree;
-	time_t mtime;
-	char *virus_scan;
-	int grev;
-	int rev;
-	struct {
-		int folders;
-		int files;
-	} count;
+	int64_t size;		/**< The file size */
+	time_t mtime;		/**< The modification time */
+	uint32_t name;		/**< Offset of the name in the pool, 0 if none */
+	uint32_t hash;		/**< Offset of the hash in the pool, 0 if none */
+	enum item_kind kind;	/**< The entry kind */
+	enum item_kind type;	/**< The entry type */
 };
 
 /**
@@ -134,6 +139,19 @@ struct space_info {
 	int status;
 };
 
+/**
+ * Struct transfer_stats holds statistics of parallel file transfers.
+ */
+struct transfer_stats {
+	int concurrency;	/**< The current number of parallel transfers allowed */
+	int max_concurrency;	/**< The upper bound of the concurrency */
+	double throughput;	/**< Throughput of the last measured second, bytes/s */
+	uint64_t bytes;		/**< Total number of bytes transferred */
+	unsigned nr_retries;	/**< Number of retried transfers */
+	unsigned nr_cuts;	/**< Number of concurrency decreases */
+	uint64_t peak_memory;	/**< Highest memory reserved for transfer buffers */
+};
+
 struct cld *new_cloud(const char *user,
 				const char *password,
 				const char *domain,
@@ -147,8 +165,48 @@ void delete_cloud(struct cld *c);
  */
 inline static bool file_list_is_dir(const struct file_list *finfo)
 {
-	return finfo && finfo->body.kind &&
-		0 == strcmp(finfo->body.kind, "folder");
+	return finfo && finfo->body.kind == KIND_FOLDER;
+}
+
+/**
+ * Get the name of an entry kind.
+ * @param kind - the kind.
+ * @return the name used by the cloud, or "?" if the kind is not known.
+ */
+inline static const char *item_kind_name(enum item_kind kind)
+{
+	switch (kind) {
+	case KIND_FILE:
+		return "file";
+	case KIND_FOLDER:
+		return "folder";
+	default:
+		return "?";
+	}
+}
+
+/**
+ * Get the name of a list item.
+ * @param finfo - the file_list structure holding the item;
+ * @param li - the item.
+ * @return the name, or NULL if the item has none.
+ */
+inline static char *list_item_name(const struct file_list *finfo,
+				   const struct list_item *li)
+{
+	return li->name ? finfo->pool.buf + li->name : NULL;
+}
+
+/**
+ * Get the hash of a list item.
+ * @param finfo - the file_list structure holding the item;
+ * @param li - the item.
+ * @return the hash, or NULL if the item has none.
+ */
+inline static char *list_item_hash(const struct file_list *finfo,
+				   const struct list_item *li)
+{
+	return li->hash ? finfo->pool.buf + li->hash : NULL;
 }
 
 /**
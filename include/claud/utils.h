@@ -23,6 +23,7 @@
 #define __UTILS_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,41 @@ extern "C" {
 #endif
 
 struct file_list;
+
+/**
+ * A growable, always NUL-terminated string buffer.
+ */
+struct strbuf {
+	char *buf;	/**< The buffer */
+	size_t len;	/**< The string length */
+	size_t size;	/**< The allocated size */
+};
+
+void strbuf_init(struct strbuf *sb);
+void strbuf_cleanup(struct strbuf *sb);
+void strbuf_reserve(struct strbuf *sb, size_t extra);
+void strbuf_append(struct strbuf *sb, const char *data, size_t len);
+
+/**
+ * Empty the buffer keeping its memory for reuse.
+ * @param sb - the buffer.
+ */
+inline static void strbuf_reset(struct strbuf *sb)
+{
+	sb->len = 0;
+	sb->buf[0] = '\0';
+}
+
+/**
+ * Cut the string in the buffer to the specified length.
+ * @param sb - the buffer;
+ * @param len - the new length, not greater than the current one.
+ */
+inline static void strbuf_truncate(struct strbuf *sb, size_t len)
+{
+	sb->len = len;
+	sb->buf[len] = '\0';
+}
 	
 /* Logging */
 
@@ -147,6 +183,12 @@ char *get_file_part_name(const char *name, int idx);
  */
 void fill_random(char *s, const size_t len);
 
+/**
+ * Get the current value of the monotonic clock.
+ * @return the time in milliseconds.
+ */
+int64_t get_time_ms(void);
+
 /**
  * Malloc wrapper terminating the program when memory runs up.
  * @param size - the requested allocation size.
@@ -0,0 +1,84 @@
+/**
+ * @file warmup.h
+ * Session warm-up API for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WARMUP_H
+#define __WARMUP_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of hosts connected in parallel */
+#define WARMUP_MAX_HOSTS 4
+/** Time limit for a single warm-up request or connection */
+#define WARMUP_TIMEOUT_MS 10000L
+
+struct conn_pool;
+struct shard_set;
+
+/**
+ * Background resolution of and connection to the hosts
+ * the session is going to use.
+ */
+struct warmup {
+	pthread_t thread;			/**< The warm-up thread */
+	bool running;				/**< Whether the thread runs */
+	bool cancelled;				/**< Set to stop the thread early */
+	CURLM *multi;				/**< Runs the thread requests */
+	pthread_mutex_t lock;			/**< Protects the data shared
+						     with the thread */
+	pthread_cond_t fetched_cond;		/**< Signals the dispatcher
+						     response */
+	struct conn_pool *pool;			/**< The pool to take handles from */
+	CURL *handles[WARMUP_MAX_HOSTS];	/**< Handles used by the thread */
+	size_t nr_handles;			/**< Number of handles taken */
+	char *urls[WARMUP_MAX_HOSTS];		/**< Host root URLs to connect */
+	size_t nr_urls;				/**< Number of URLs */
+	long rtt_us[WARMUP_MAX_HOSTS];		/**< Measured round-trip times */
+	struct shard_set *set;			/**< The set the times go to */
+	char *token;				/**< Token for the dispatcher request */
+	struct request req;			/**< The thread request builder */
+	bool fetched;				/**< Whether the dispatcher
+						     request is over */
+	bool have_shards;			/**< Whether shards were fetched */
+	struct shard_info shards;		/**< The fetched shards */
+};
+
+void warmup_init(struct warmup *w, struct conn_pool *pool);
+void warmup_cleanup(struct warmup *w);
+int warmup_start(struct warmup *w, const char *urls[], size_t nr_urls,
+		 const char *token);
+void warmup_wait(struct warmup *w);
+void warmup_cancel(struct warmup *w);
+int warmup_take_shards(struct warmup *w, struct shard_info *s);
+void warmup_report_probes(struct warmup *w, struct shard_set *set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __WARMUP_H */
@@ -17,7 +17,8 @@ static const char* ERROR_FEW_ARGS = "Not enough arguments\n";
 static const char* ERROR_ALLOC_ARGS = "Could not allocate memory for arguments\n";
 static const char* ERROR_WRONG_CMD = "Wrong command\n";
 
-static int print_file_list_item(struct list_item *li)
+static int print_file_list_item(void *arg, const struct file_list *finfo,
+				const struct list_item *li)
 {
 	struct tm tm = { 0 };
 	char time_str[80];
@@ -36,34 +37,24 @@ static int print_file_list_item(struct list_item *li)
 	}	
 	
 	printf("%-6s %11ld %-12s %-20s\n",
-		li->kind,
+		item_kind_name(li->kind),
 		li->size,
 		time_str,
-		li->name);
+		list_item_name(finfo, li));
 	return 0;
 }
 
-static int print_file_list(struct file_list *finfo)
-{
-	size_t i;
-	for (i = 0; i < finfo->body.nr_list_items; i++)
-		if (print_file_list_item(&finfo->body.list[i]))
-			return 1;
-	return 0;	
-}
-
 static int command_print_file_list(struct command *cmd)
 {
-	int res;
 	const char *path = cmd->args[0];
-	struct file_list finfo = { 0 };
-	if (cld_get_file_list(cmd->cld, path, &finfo, cmd->raw)) {
+
+	/* The listing is printed page by page as it is received */
+	if (cld_iterate_file_list(cmd->cld, path, cmd->raw,
+				  print_file_list_item, NULL)) {
 		log_error("Could not read file list\n");
 		return 1;
 	}
-	res = print_file_list(&finfo);
-	cld_file_list_cleanup(&finfo);
-	return res;
+	return 0;
 }
 
 static int print_file_stat(struct file_list *finfo)
@@ -85,7 +76,7 @@ static int print_file_stat(struct file_list *finfo)
 	}	
 	
 	printf("%-6s %11ld %-12s %-20s hash:%s\n",
-		finfo->body.kind,
+		item_kind_name(finfo->body.kind),
 		finfo->body.size,
 		time_str,
 		finfo->body.name,
@@ -40,6 +40,10 @@ void help(FILE *f)
 	fprintf(f, "Options:\n"
 		"  -h, --help                   Print this help message\n"
 		"  -v, --verbose                Level of verbosity (0-3)\n"
+		"  -j, --jobs                   Maximum number of parallel transfers\n"
+		"  -l, --limit-rate             Bandwidth limit in KiB/s for each direction\n"
+		"  -m, --memory                 Memory for transfer buffers in MiB,\n"
+		"                               4 MiB per job by default, at most 64\n"
 		"\n");
 	fprintf(f, "Commands := < cp | cat | get | ls | mkdir | mv | put | rm | share | stat | df >\n\n");
 	fprintf(f, "Example: %s ls\n", program_name);
@@ -57,6 +61,9 @@ int main(int argc, char *argv[])
 	program_name = argv[0];
 	int index;
 	int err;
+	int jobs = 0;
+	long limit_rate = 0;
+	size_t memory = 0;
 	struct command cmd = { 0, };
 	struct cld *c;
 	
@@ -66,6 +73,9 @@ int main(int argc, char *argv[])
 		{"verbose", 0, 0,'v'},
 		{"progress", 0, 0,'p'},
 		{"raw", 0, 0,'r'},
+		{"jobs", 1, 0,'j'},
+		{"limit-rate", 1, 0,'l'},
+		{"memory", 1, 0,'m'},
 		{0,0,0,0}
 	};
 	
@@ -73,7 +83,7 @@ int main(int argc, char *argv[])
 	
 	while(1) {
 		int option_index = 0;
-		int opt = getopt_long (argc, argv, "hprv:", 
+		int opt = getopt_long (argc, argv, "hj:l:m:prv:", 
 			loptions, &option_index);
 		if (opt==-1) break;
 	
@@ -82,6 +92,15 @@ int main(int argc, char *argv[])
 			help(stdout);
 			exit(0);
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'l':
+			limit_rate = atol(optarg) * 1024;
+			break;
+		case 'm':
+			memory = strtoul(optarg, NULL, 10) << 20;
+			break;
 		case 'p':
 			cmd.progress = true;
 			break;
@@ -107,7 +126,14 @@ int main(int argc, char *argv[])
 	curl_global_init(CURL_GLOBAL_ALL);
 	c = new_cloud(getenv("MAILRU_USER"), getenv("MAILRU_PASSWORD"),
 		      "mail.ru", &err);
-	if (c) {
+	if (c && ((jobs && cld_set_max_concurrency(c, jobs)) ||
+		  (limit_rate &&
+		   cld_set_bandwidth_limit(c, limit_rate, limit_rate)) ||
+		  (memory && cld_set_memory_budget(c, memory)))) {
+		delete_cloud(c);
+		c = NULL;
+		err = 1;
+	} else if (c) {
 		cmd.cld = c;
 		cmd.handle(&cmd);
 		err = cmd.err;
@@ -0,0 +1,158 @@
+/**
+ * @file arena.c
+ * Region memory allocators for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <claud/arena.h>
+#include <claud/utils.h>
+
+/** Alignment of the allocations */
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_block {
+	struct arena_block *next;	/**< The previously filled block */
+	size_t size;			/**< The size of the data */
+	size_t used;			/**< The amount of data allocated */
+	max_align_t data[];		/**< The data */
+};
+
+/**
+ * Take memory from the arena. A request which does not fit into
+ * the current block starts a new one, the rest of the current block
+ * is not used any more.
+ * @param a - the arena;
+ * @param size - the amount of memory;
+ * @param align - the alignment, a power of two up to ARENA_ALIGN.
+ * @return the memory. The function does not return if the memory
+ * is exhausted.
+ */
+static void *arena_take(struct arena *a, size_t size, size_t align)
+{
+	struct arena_block *b = a->head;
+	size_t offset = b ? (b->used + align - 1) & ~(align - 1) : 0;
+
+	if (!b || offset > b->size || b->size - offset < size) {
+		size_t block_size = size > ARENA_BLOCK_SIZE
+			? size : ARENA_BLOCK_SIZE;
+
+		b = xmalloc(sizeof(*b) + block_size);
+		b->size = block_size;
+		b->next = a->head;
+		a->head = b;
+		offset = 0;
+	}
+	b->used = offset + size;
+	return (char *)b->data + offset;
+}
+
+/**
+ * Allocate memory from the arena.
+ * @param a - the arena;
+ * @param size - the amount of memory.
+ * @return the memory, aligned for any type. The function does not
+ * return if the memory is exhausted.
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	return arena_take(a, size, ARENA_ALIGN);
+}
+
+/**
+ * Copy a string to the arena.
+ * @param a - the arena;
+ * @param s - the string;
+ * @param len - the string length.
+ * @return the NUL-terminated copy.
+ */
+char *arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char *p = arena_take(a, len + 1, 1);
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+/**
+ * Free all the memory allocated from the arena. The arena is left
+ * empty and may be used again.
+ * @param a - the arena.
+ */
+void arena_release(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	for (b = a->head; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	a->head = NULL;
+}
+
+/**
+ * Add a string to the pool.
+ * @param p - the pool;
+ * @param s - the string;
+ * @param len - the string length.
+ * @return the offset of the NUL-terminated copy. The function does
+ * not return if the memory or the offsets are exhausted.
+ */
+uint32_t str_pool_add(struct str_pool *p, const char *s, size_t len)
+{
+	size_t offset;
+
+	if (!p->len) {
+		/* Offset 0 is taken by an empty string */
+		p->size = ARENA_BLOCK_SIZE;
+		p->buf = xmalloc(p->size);
+		p->buf[0] = '\0';
+		p->len = 1;
+	}
+	if (len >= UINT32_MAX - p->len) {
+		log_error("String pool overflow\n");
+		exit(1);
+	}
+	offset = p->len;
+	if (p->size - offset < len + 1) {
+		while (p->size - offset < len + 1)
+			p->size *= 2;
+		p->buf = xrealloc(p->buf, p->size);
+	}
+	memcpy(p->buf + offset, s, len);
+	p->buf[offset + len] = '\0';
+	p->len += len + 1;
+	return (uint32_t)offset;
+}
+
+/**
+ * Free the strings of the pool. The pool is left empty and may be
+ * used again.
+ * @param p - the pool.
+ */
+void str_pool_release(struct str_pool *p)
+{
+	free(p->buf);
+	p->buf = NULL;
+	p->len = 0;
+	p->size = 0;
+}
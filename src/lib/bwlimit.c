@@ -0,0 +1,175 @@
+/**
+ * @file bwlimit.c
+ * Token bucket bandwidth limiting for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <claud/bwlimit.h>
+
+static int64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double bucket_burst(const struct bw_bucket *b)
+{
+	double burst = (double)b->rate * BW_BURST_MS / 1000;
+	return burst < BW_MIN_BURST ? BW_MIN_BURST : burst;
+}
+
+/**
+ * Add the tokens accumulated since the last refill. The bucket holds
+ * a short burst only, so an idle period does not let a transfer
+ * exceed the rate afterwards.
+ * @param b - the bucket;
+ * @param now - the current time.
+ */
+static void bucket_refill(struct bw_bucket *b, int64_t now)
+{
+	double burst = bucket_burst(b);
+
+	b->tokens += (double)b->rate * (now - b->last_ns) / 1e9;
+	if (b->tokens > burst)
+		b->tokens = burst;
+	b->last_ns = now;
+}
+
+void bw_limit_init(struct bw_limit *bw)
+{
+	memset(bw, 0, sizeof(*bw));
+	pthread_mutex_init(&bw->lock, NULL);
+}
+
+void bw_limit_cleanup(struct bw_limit *bw)
+{
+	pthread_mutex_destroy(&bw->lock);
+}
+
+/**
+ * Change the rate of a direction. Transfers in progress follow
+ * the new rate from their next callback.
+ * @param bw - the bandwidth limit;
+ * @param dir - the direction;
+ * @param rate - bytes per second, 0 for no limit.
+ */
+void bw_limit_set(struct bw_limit *bw, enum bw_dir dir, long rate)
+{
+	struct bw_bucket *b = &bw->buckets[dir];
+
+	pthread_mutex_lock(&bw->lock);
+	b->rate = rate;
+	b->tokens = 0;
+	b->last_ns = get_time_ns();
+	pthread_mutex_unlock(&bw->lock);
+}
+
+/**
+ * Limit the amount of data a callback passes at once to the bucket
+ * capacity, so that transfers are paced in small steps.
+ * @param bw - the bandwidth limit, or NULL;
+ * @param dir - the direction;
+ * @param size - the amount the callback could pass.
+ * @return the amount to pass.
+ */
+size_t bw_limit_chunk(struct bw_limit *bw, enum bw_dir dir, size_t size)
+{
+	size_t burst;
+
+	if (!bw)
+		return size;
+	pthread_mutex_lock(&bw->lock);
+	burst = bw->buckets[dir].rate
+		? (size_t)bucket_burst(&bw->buckets[dir])
+		: size;
+	pthread_mutex_unlock(&bw->lock);
+	return size < burst ? size : burst;
+}
+
+/**
+ * Account bytes a transfer run by a multi handle is about to pass,
+ * without sleeping. The bytes may pass unless the bucket is in debt
+ * already, then they are not accounted and the transfer should be
+ * paused.
+ * @param bw - the bandwidth limit, or NULL;
+ * @param dir - the direction;
+ * @param bytes - the number of bytes.
+ * @return 0 if the bytes may pass, otherwise the time in ms,
+ * as returned by get_time_ms(), to resume the transfer at.
+ */
+int64_t bw_limit_pause(struct bw_limit *bw, enum bw_dir dir, size_t bytes)
+{
+	struct bw_bucket *b;
+	int64_t now, wait_ns = 0;
+
+	if (!bw)
+		return 0;
+	b = &bw->buckets[dir];
+
+	pthread_mutex_lock(&bw->lock);
+	now = get_time_ns();
+	if (b->rate) {
+		bucket_refill(b, now);
+		if (b->tokens < 0)
+			wait_ns = (int64_t)(-b->tokens * 1e9 / b->rate);
+		else
+			b->tokens -= bytes;
+	}
+	pthread_mutex_unlock(&bw->lock);
+
+	return wait_ns > 0 ? (now + wait_ns) / 1000000 + 1 : 0;
+}
+
+/**
+ * Account transferred bytes and sleep until the rate allows them.
+ * The bytes are reserved right away, so that callers waiting at
+ * the same time are served one after another.
+ * @param bw - the bandwidth limit, or NULL;
+ * @param dir - the direction;
+ * @param bytes - the number of bytes.
+ */
+void bw_limit_take(struct bw_limit *bw, enum bw_dir dir, size_t bytes)
+{
+	struct bw_bucket *b;
+	struct timespec ts;
+	int64_t wait_ns = 0;
+
+	if (!bw)
+		return;
+	b = &bw->buckets[dir];
+
+	pthread_mutex_lock(&bw->lock);
+	if (b->rate) {
+		bucket_refill(b, get_time_ns());
+		b->tokens -= bytes;
+		if (b->tokens < 0)
+			wait_ns = (int64_t)(-b->tokens * 1e9 / b->rate);
+	}
+	pthread_mutex_unlock(&bw->lock);
+
+	if (wait_ns <= 0)
+		return;
+	ts.tv_sec = wait_ns / 1000000000;
+	ts.tv_nsec = wait_ns % 1000000000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
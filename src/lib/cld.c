@@ -25,93 +25,23 @@
 #include <curl/curl.h>
 #include <claud/types.h>
 #include <claud/http_api.h>
+#include <claud/bwlimit.h>
 #include <claud/cld.h>
+#include <claud/conn_pool.h>
+#include <claud/hedge.h>
+#include <claud/mem_budget.h>
+#include <claud/session.h>
+#include <claud/shards.h>
+#include <claud/thread.h>
+#include <claud/transfer.h>
+#include <claud/warmup.h>
 #include <claud/utils.h>
 
-#define COOKIE_FILE "/tmp/claud_cookies.txt"
-#define LOGIN_URL "https://auth.mail.ru/cgi-bin/auth"
-#define SDC_URL "https://auth.mail.ru/sdc?from=https://cloud.mail.ru/home"
-
-static int login(struct cld *c,
-		 const char *user,
-		 const char *password,
-		 const char *domain)
-{
-	struct memory_struct chunk;
-	memory_struct_init(&chunk);
-	
-	const char *names[] = { "Domain", "Login", "Password" };
-	const char *values[] = { domain, user, password };
-	
-	int res = post_form_req(c->curl, &chunk, LOGIN_URL, names,
-				values, ARRAY_SIZE(names));
-
-	memory_struct_cleanup(&chunk);
-	return res;
-}
-
-static char *find_token(const char *data, size_t *len) {
-	static const char *tag = "\"token\":\"";
-	char *start = strstr(data, tag);
-	char *end;
-	if (!start)
-		return NULL;
-	start += strlen(tag);
-	end = strchr(start, '"');
-	if (!end)
-		return NULL;
-	*len = end - start;
-	return start;
-}
-
-static char *store_token(const char *data)
-{
-	char *buf = NULL;
-	size_t token_len;
-	char *token = find_token(data, &token_len);
-	if (!token || !token_len) {
-		log_error("Token not found\n");
-		return NULL;
-	}
-
-	if (!(buf = malloc(token_len + 1))) {
-		log_error("Token allocation failed\n");
-		return NULL;
-	}
-
-	memcpy(buf, token, token_len);
-	buf[token_len] = 0;
-	
-	return buf;
-}
-
-/**
- * Request a token over HTTP, allocate a memory
- * buffer and store the token in the buffer.
- * @return a pointer to the buffer for success, or NULL for error
- */
-static char *get_token(CURL *curl)
-{
-	char *buf = NULL;
-	int res;
-	struct memory_struct chunk;
-	char *url = make_url("tokens/csrf");
-	if (!url)
-		return NULL;
-
-	memory_struct_init(&chunk);
-	
-	if (!get_req(curl, &chunk, url))
-		buf = store_token(chunk.memory);
-
-	memory_struct_cleanup(&chunk);
-	free(url);
-	
-	return buf;
-}
+#define LOGOUT_URL "http://win.mail.ru/cgi-bin/logout"
 
 // NewCloud authenticates with mail.ru and returns a new object associated with user account.
 // domain parameter should be "mail.ru"
+// A session cached by a previous call is used without logging in.
 struct cld *new_cloud(const char *user,
 				const char *password,
 				const char *domain,
@@ -119,6 +49,7 @@ struct cld *new_cloud(const char *user,
 {
 	struct cld *c;
 	CURL *curl;
+	const char *warmup_urls[] = { CLOUD_ENDPOINT };
 	
 	*error = 1; // by default
 
@@ -134,18 +65,56 @@ struct cld *new_cloud(const char *user,
 		return NULL;
 	}
 	c->curl = curl;
+	c->stall_speed = STALL_SPEED_LIMIT;
+	c->stall_time = STALL_TIME;
 
-	/* export cookies to this file when closing the handle */
-	curl_easy_setopt(curl, CURLOPT_COOKIEJAR, COOKIE_FILE);
-	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, COOKIE_FILE);
-	if (login(c, user, password, domain))
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_mutex_init(&c->shards_lock, NULL);
+	if (cld_threads_init(c)) {
+		pthread_mutex_destroy(&c->shards_lock);
+		pthread_mutex_destroy(&c->lock);
+		curl_easy_cleanup(curl);
+		free(c);
+		return NULL;
+	}
+	c->hedge = xmalloc(sizeof(*c->hedge));
+	hedge_init(c->hedge);
+	c->shards = xmalloc(sizeof(*c->shards));
+	shard_set_init(c->shards);
+	c->xfer = xmalloc(sizeof(*c->xfer));
+	xfer_init(c->xfer);
+	c->bw = xmalloc(sizeof(*c->bw));
+	bw_limit_init(c->bw);
+	c->budget = xmalloc(sizeof(*c->budget));
+	mem_budget_init(c->budget,
+			mem_budget_default(XFER_DEFAULT_MAX_CONCURRENCY));
+	c->pool = xmalloc(sizeof(*c->pool));
+	if (conn_pool_init(c->pool))
 		goto cleanup;
+	conn_pool_attach(c->pool, curl);
+	c->warmup = xmalloc(sizeof(*c->warmup));
+	warmup_init(c->warmup, c->pool);
+	c->session = xmalloc(sizeof(*c->session));
+	session_init(c->session, user, password, domain);
 
-	if (get_req(curl, NULL, SDC_URL))
-		goto cleanup;
-	
-	if (!(c->auth_token = get_token(curl)))
+	/* The cached session is validated by the first request */
+	if (!session_restore(c)) {
+		warmup_start(c->warmup, warmup_urls, ARRAY_SIZE(warmup_urls),
+			     c->auth_token);
+		*error = 0;
+		return c;
+	}
+
+	/*
+	 * Connect to the cloud host while logging in, the shard hosts
+	 * are connected as soon as the token is known.
+	 */
+	warmup_start(c->warmup, warmup_urls, ARRAY_SIZE(warmup_urls), NULL);
+
+	if (session_login(c))
 		goto cleanup;
+
+	warmup_start(c->warmup, NULL, 0, c->auth_token);
 	
 	/* Success */
 	*error = 0;
@@ -153,19 +122,152 @@ struct cld *new_cloud(const char *user,
 	
 	/* Errors */
 cleanup:
+	if (c->warmup)
+		warmup_cleanup(c->warmup);
+	free(c->warmup);
+	if (c->session)
+		session_cleanup(c->session);
+	free(c->session);
 	curl_easy_cleanup(curl);
+	cld_threads_cleanup(c);
+	conn_pool_cleanup(c->pool);
+	free(c->pool);
+	hedge_cleanup(c->hedge);
+	free(c->hedge);
+	shard_set_cleanup(c->shards);
+	free(c->shards);
+	if (c->xfer)
+		xfer_cleanup(c->xfer);
+	free(c->xfer);
+	if (c->bw)
+		bw_limit_cleanup(c->bw);
+	free(c->bw);
+	if (c->budget)
+		mem_budget_cleanup(c->budget);
+	free(c->budget);
+	free(c->auth_token);
+	pthread_mutex_destroy(&c->shards_lock);
+	pthread_mutex_destroy(&c->lock);
 	free(c);
 	return NULL;
 }
 
 void delete_cloud(struct cld *c)
 {
-	if (get_req(c->curl, NULL, "http://win.mail.ru/cgi-bin/logout"))
+	/*
+	 * Do not touch the session while the warm-up thread uses it,
+	 * the connections it has not made yet are of no use anymore.
+	 */
+	warmup_cancel(c->warmup);
+	warmup_wait(c->warmup);
+	if (c->session->cookie_file) {
+		/* Keep the session for the next call */
+		session_save(c);
+	} else if (get_req(c->curl, NULL, LOGOUT_URL)) {
 		log_error("Logout failed\n");
+	}
 	
+	warmup_cleanup(c->warmup);
+	free(c->warmup);
+	session_cleanup(c->session);
+	free(c->session);
+	/* The engine keeps connections made by pooled handles */
+	xfer_cleanup(c->xfer);
+	free(c->xfer);
 	curl_easy_cleanup(c->curl);
-	free(c->shard.get);
-	free(c->shard.upload);
+	cld_threads_cleanup(c);
+	conn_pool_cleanup(c->pool);
+	free(c->pool);
+	hedge_cleanup(c->hedge);
+	free(c->hedge);
+	shard_set_cleanup(c->shards);
+	free(c->shards);
+	bw_limit_cleanup(c->bw);
+	free(c->bw);
+	mem_budget_cleanup(c->budget);
+	free(c->budget);
 	free(c->auth_token);
+	pthread_mutex_destroy(&c->shards_lock);
+	pthread_mutex_destroy(&c->lock);
 	free(c);
 }
+
+/**
+ * Configure detection of stalled file transfers. A transfer slower
+ * than the minimum speed during the whole window is aborted and
+ * continued on a new connection.
+ * @param c - the cloud descriptor;
+ * @param min_speed - the minimum speed in bytes per second,
+ * 0 to disable stall detection;
+ * @param window - the window in seconds.
+ * @return 0 for success, or 1 for wrong parameters.
+ */
+int cld_set_stall_limits(struct cld *c, long min_speed, long window)
+{
+	if (min_speed < 0 || (min_speed && window <= 0)) {
+		log_error("Wrong stall detection parameters\n");
+		return 1;
+	}
+	pthread_mutex_lock(&c->lock);
+	c->stall_speed = min_speed;
+	c->stall_time = window;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/**
+ * Enable or disable sizing of the transfer and socket buffers from
+ * the bandwidth-delay product measured for each shard. When disabled,
+ * fixed buffer sizes are used.
+ * @param c - the cloud descriptor;
+ * @param enabled - whether adaptive sizing is enabled.
+ */
+void cld_set_adaptive_buffers(struct cld *c, bool enabled)
+{
+	pthread_mutex_lock(&c->lock);
+	c->adaptive_buffers = enabled;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Limit the bandwidth used by file transfers. The limit is shared
+ * by all transfers of the session and may be changed while they run.
+ * @param c - the cloud descriptor;
+ * @param down - the download rate in bytes per second, 0 for no limit;
+ * @param up - the upload rate in bytes per second, 0 for no limit.
+ * @return 0 for success, or 1 for a rate below BW_MIN_RATE.
+ */
+int cld_set_bandwidth_limit(struct cld *c, long down, long up)
+{
+	if (down < 0 || up < 0 || (down && down < BW_MIN_RATE) ||
+	    (up && up < BW_MIN_RATE)) {
+		log_error("The bandwidth limit must be at least %ld bytes/s\n",
+			  BW_MIN_RATE);
+		return 1;
+	}
+	bw_limit_set(c->bw, BW_DOWN, down);
+	bw_limit_set(c->bw, BW_UP, up);
+	return 0;
+}
+
+/**
+ * Set the memory the buffers of running file transfers may take.
+ * Transfers wait for memory while the budget is exhausted, so the
+ * memory used does not grow with the number of parallel transfers.
+ * Metadata requests are charged to the budget too, but never wait.
+ * Until a budget is set, it is MEM_BUDGET_PER_TRANSFER for each
+ * parallel transfer allowed, at most MEM_BUDGET_DEFAULT_MAX.
+ * @param c - the cloud descriptor;
+ * @param size - the budget in bytes, at least MEM_BUDGET_MIN.
+ * @return 0 for success, or 1 for a too small budget.
+ */
+int cld_set_memory_budget(struct cld *c, size_t size)
+{
+	if (size < MEM_BUDGET_MIN) {
+		log_error("The memory budget must be at least %lu bytes\n",
+			  MEM_BUDGET_MIN);
+		return 1;
+	}
+	mem_budget_set_limit(c->budget, size);
+	return 0;
+}
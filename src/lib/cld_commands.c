@@ -21,6 +21,7 @@
 
 #include <curl/curl.h>
 #include <malloc.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
@@ -29,6 +30,8 @@
 #include <claud/http_api.h>
 #include <claud/cld.h>
 #include <claud/jsmn_utils.h>
+#include <claud/session.h>
+#include <claud/thread.h>
 #include <claud/utils.h>
 
 /**
@@ -40,19 +43,22 @@
 int cld_remove(struct cld *c, const char *path)
 {
 	int res;
-	const char *names[] = { "token", "api", "home" };
-	const char *values[] = { c->auth_token, "2", path };
-	char *url = make_url("file/remove");
+	const char *names[] = { "api", "home" };
+	const char *values[] = { "2", path };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/remove");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 	
 	struct memory_struct chunk;
 	memory_struct_init(&chunk);
 
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
+	res = api_post_req(c, &chunk);
 	if (res)
 		log_error("command_remove failed, Msg: %.*s\n",
 			(int)chunk.size, chunk.memory);
 	
-	free(url);
 	memory_struct_cleanup(&chunk);
 
 	return res;
@@ -67,19 +73,22 @@ int cld_remove(struct cld *c, const char *path)
 int cld_mkdir(struct cld *c, const char *path)
 {
 	int res;
-	const char *names[] = { "token", "api", "home", "conflict" };
-	const char *values[] = { c->auth_token, "2", path, "strict" };
-	char *url = make_url("folder/add");
+	const char *names[] = { "api", "home", "conflict" };
+	const char *values[] = { "2", path, "strict" };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "folder/add");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 	
 	struct memory_struct chunk;
 	memory_struct_init(&chunk);
 
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
+	res = api_post_req(c, &chunk);
 	if (res)
 		log_error("c_mkdir failed, Msg: %.*s\n",
 			(int)chunk.size, chunk.memory);
 	
-	free(url);
 	memory_struct_cleanup(&chunk);
 
 	return res;
@@ -97,17 +106,20 @@ static int c_move_a(struct cld *c, const char *src,
 {
 	int res;
 	const char *names[] =
-		{ "token", "api", "conflict", "home", "folder" };
+		{ "api", "conflict", "home", "folder" };
 	const char *values[] =
-		{ c->auth_token, "2", "strict", src, target_dir };
-	char *url = make_url("file/move");
+		{ "2", "strict", src, target_dir };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/move");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 
 	struct memory_struct chunk;
 	
 	memory_struct_init(&chunk);
 
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
-	free(url);
+	res = api_post_req(c, &chunk);
 
 	memory_struct_cleanup(&chunk);
 	return res;
@@ -125,17 +137,20 @@ static int c_rename(struct cld *c, const char *src,
 {
 	int res;
 	const char *names[] =
-		{ "token", "api", "conflict", "home", "name" };
+		{ "api", "conflict", "home", "name" };
 	const char *values[] =
-		{ c->auth_token, "2", "strict", src, target_name };
-	char *url = make_url("file/rename");
+		{ "2", "strict", src, target_name };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/rename");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 
 	struct memory_struct chunk;
 	memory_struct_init(&chunk);
 
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
+	res = api_post_req(c, &chunk);
 
-	free(url);
 	memory_struct_cleanup(&chunk);
 
 	return res;
@@ -270,17 +285,20 @@ static int c_copy_a(struct cld *c, const char *src,
 {
 	int res;
 	const char *names[] =
-		{ "token", "api", "conflict", "home", "folder" };
+		{ "api", "conflict", "home", "folder" };
 	const char *values[] =
-		{ c->auth_token, "2", "strict", src, target_dir };
-	char *url = make_url("file/copy");
+		{ "2", "strict", src, target_dir };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/copy");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 	
 	struct memory_struct chunk;
 	memory_struct_init(&chunk);
 
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
+	res = api_post_req(c, &chunk);
 
-	free(url);
 	memory_struct_cleanup(&chunk);
 
 	return res;
@@ -362,29 +380,36 @@ cleanup:
 	return res;
 }
 
+static const struct json_field space_body_fields[] = {
+	{ .name = "bytes_total", .type = JSON_INT64,
+	  .offset = offsetof(struct space_info, body.bytes_total) },
+	{ .name = "bytes_used", .type = JSON_INT64,
+	  .offset = offsetof(struct space_info, body.bytes_used) },
+	{ .name = "overquota", .type = JSON_BOOL,
+	  .offset = offsetof(struct space_info, body.overquota) },
+};
+
+static const struct json_field space_info_fields[] = {
+	{ .name = "time", .type = JSON_TIME,
+	  .offset = offsetof(struct space_info, time) },
+	{ .name = "status", .type = JSON_INT,
+	  .offset = offsetof(struct space_info, status) },
+	{ .name = "body", .type = JSON_OBJECT, .required = true,
+	  .fields = space_body_fields,
+	  .nr_fields = ARRAY_SIZE(space_body_fields) },
+};
+
 static int parse_space_info(const char *js, jsmntok_t *tok, struct space_info *info)
 {
-	jsmntok_t *body;
-	size_t count, body_count;
-	
-	count = get_json_element_count(tok);
-/*
-	if (!(info->email = get_json_string_by_name(js, tok, count, "email"))) {
-		log_error("Wrongly formatted space info\n");
+	struct json_decoder d;
+
+	if (json_decoder_init(&d, space_info_fields,
+			      ARRAY_SIZE(space_info_fields)))
 		return 1;
-	}
-*/	
-	info->time = (time_t)get_json_int64_by_name(js, tok, count, "time");
-	info->status = get_json_int_by_name(js, tok, count, "status");
-	body = find_json_element_by_name(js, tok, count, JSMN_OBJECT, "body");
-	if (!body) {
+	if (json_decode_object(js, tok, &d, info, NULL)) {
 		log_error("Wrongly formatted space info\n");
 		return 1;
 	}
-	body_count = get_json_element_count(body);
-	info->body.bytes_total = (uint64_t)get_json_int64_by_name(js, body, body_count, "bytes_total");
-	info->body.bytes_used = (uint64_t)get_json_int64_by_name(js, body, body_count, "bytes_used");
-	info->body.overquota = get_json_bool_by_name(js, body, body_count, "overquota");
 	return 0;
 }
 
@@ -403,16 +428,16 @@ int cld_df(struct cld *c, struct space_info *info)
 	size_t tokcount = 0;
 	struct memory_struct chunk;
 
-	const char *names[] = { "token", "api" };
-	const char *values[] = { c->auth_token, "2" };
-	char *url = make_url_with_params(c->curl, "user/space", names,
-					 values, ARRAY_SIZE(names));
-	if (!url)
+	const char *names[] = { "api" };
+	const char *values[] = { "2" };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "user/space");
+	if (request_add_params(req, names, values, ARRAY_SIZE(names)))
 		return 1;
 	
 	memory_struct_init(&chunk);
-	res = get_req(c->curl, &chunk, url);
-	free(url);
+	res = api_get_req(c, &chunk);
 
 	if (res) {
 		log_error("Get failed\n");
@@ -426,12 +451,11 @@ int cld_df(struct cld *c, struct space_info *info)
 	tok = parse_json(&p, chunk.memory, chunk.size, &tokcount);
 	if (!tok) {
 		log_error("Could not parse JSON\n");
-		chunk.memory[chunk.size - 1] = 0;
-		log_error("%s\n", chunk.memory);
+		log_error("%.*s\n", (int)chunk.size, chunk.memory);
 		res = 1;
 	} else {
 		res = parse_space_info(chunk.memory, tok, info);
-		free(tok);
+		json_tokens_release(tok);
 	}
 	
 	memory_struct_cleanup(&chunk);
@@ -21,6 +21,7 @@
 
 
 #include <curl/curl.h>
+#include <errno.h>
 #include <malloc.h>
 #include <string.h>
 #include <time.h>
@@ -34,40 +35,149 @@
 #include <claud/types.h>
 #include <claud/http_api.h>
 #include <claud/cld.h>
+#include <claud/bwlimit.h>
 #include <claud/jsmn_utils.h>
+#include <claud/mem_budget.h>
+#include <claud/shards.h>
+#include <claud/thread.h>
+#include <claud/transfer.h>
 #include <claud/utils.h>
 
+/**
+ * The destination of a streamed download.
+ */
+struct get_sink {
+	CURL *curl;		/**< The handle of the download */
+	int fd;			/**< The file descriptor written */
+	size_t written;		/**< Bytes written by all attempts */
+	size_t offset;		/**< Bytes written before the attempt */
+	struct bw_limit *bw;	/**< The bandwidth limit, or NULL */
+};
+
+/**
+ * Write received data straight to the file descriptor, so that
+ * only the CURL buffer is held in memory.
+ */
+static size_t sink_write(void *data, size_t size, size_t nmemb, void *userp)
+{
+	struct get_sink *sink = (struct get_sink *)userp;
+	size_t len = size * nmemb;
+	char *p = (char *)data;
+	long code = 0;
+
+	curl_easy_getinfo(sink->curl, CURLINFO_RESPONSE_CODE, &code);
+	/* The data written cannot be taken back */
+	if (sink->offset && code != 206)
+		return 0;
+	bw_limit_take(sink->bw, BW_DOWN, len);
+
+	while (len) {
+		ssize_t n = write(sink->fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("Could not write to file: %s\n",
+				  strerror(errno));
+			return 0;
+		}
+		p += n;
+		len -= n;
+		sink->written += n;
+	}
+	return size * nmemb;
+}
+
+/**
+ * Download a remote file and write it to a file descriptor
+ * as it arrives. The fastest get shard is used, failing over
+ * to other shards on errors. A stalled download is continued
+ * from the received offset on a new connection.
+ * @param c - the cloud client;
+ * @param fd - the file descriptor;
+ * @param src - the remote path.
+ * @return 0 for success, or error code.
+ */
 int cld_get_part(struct cld *c, int fd, const char *src)
 {
-	int res = 0;
-	jsmn_parser p;
-	jsmntok_t *tok = NULL;
-	size_t tokcount = 0;
+	int res = 1;
+	int nr_failures = 0, nr_restarts = 0;
 	struct memory_struct chunk;
-	char *url;
-
-	if (cld_get_shard_info(c))
-		return 1;
-	
-	url = malloc(strlen(c->shard.get) + strlen(src) + 1);
-	if (!url)
-		return 1;
-	strcpy(url, c->shard.get);
-	strcat(url, src);
+	CURL *curl = cld_curl(c);
+	struct request *req = cld_req(c);
+	struct get_sink sink = { curl, fd, 0, 0, c->bw };
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	bool adaptive;
 
 	memory_struct_init(&chunk);
 	chunk.buf_size = DOWNLOAD_BUFFERSIZE;
-	chunk.show_progress = true;
-	
-	res = get_req(c->curl, &chunk, url);
-	free(url);
-	
-	if (!res) {
-		ssize_t written = write(fd, chunk.memory, chunk.size);
-		if (written < (ssize_t)chunk.size) {
-			log_error("Could not write to file\n");
-			res = 1;
+	chunk.resume = true;
+	pthread_mutex_lock(&c->lock);
+	chunk.stall_speed = c->stall_speed;
+	chunk.stall_time = c->stall_time;
+	adaptive = c->adaptive_buffers;
+	pthread_mutex_unlock(&c->lock);
+
+	while (nr_failures < SHARD_MAX_ATTEMPTS) {
+		size_t received = sink.written, reserved;
+		struct shard *sh;
+
+		/* The dispatcher is asked again after a shard failure */
+		if (cld_get_shard_info(c))
+			break;
+		if (!(sh = shard_select(c->shards, &c->shards->get)))
+			break;
+
+		request_url(req, sh->url, src);
+		if (adaptive)
+			shard_buffer_sizes(sh, &chunk.buf_size,
+					   &chunk.sock_buf_size);
+		chunk.size = sink.offset = sink.written;
+
+		curl_easy_reset(curl);
+		http_req_setup(curl, &chunk, req->url.buf, NULL);
+		/* Error responses must not get into the file */
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sink_write);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+		reserved = http_req_buffers(&chunk, false);
+		mem_budget_acquire(c->budget, reserved);
+		res = http_req_result(curl, &chunk, curl_easy_perform(curl));
+		mem_budget_release(c->budget, reserved);
+		/* The server ignored the range, which is not a shard failure */
+		if (res && sink.offset && chunk.code == 200) {
+			shard_end(sh, curl, SHARD_CANCELLED);
+			if (start < 0 || lseek(fd, start, SEEK_SET) < 0 ||
+			    ftruncate(fd, start)) {
+				log_error("The download of %s cannot be "
+					  "resumed\n", src);
+				break;
+			}
+			log_warn("Download of %s cannot be resumed, "
+				 "starting over\n", req->url.buf);
+			sink.written = 0;
+			/*
+			 * Starting over once is fine, but a server which
+			 * keeps stalling would be restarted forever
+			 */
+			if (nr_restarts++)
+				nr_failures++;
+			continue;
+		}
+		/* A retired shard may be freed by shard_end() */
+		if (!shard_end(sh, curl, res))
+			break;
+		shard_set_invalidate(c->shards);
+
+		/* Progress was made, so only the connection failed */
+		if (sink.written > received) {
+			log_warn("Download of %s stopped at %zu bytes, "
+				 "resuming\n", req->url.buf, sink.written);
+			continue;
 		}
+
+		nr_failures++;
+		log_warn("Download of %s failed, trying another shard\n",
+			 req->url.buf);
 	}
 	
 	memory_struct_cleanup(&chunk);
@@ -75,44 +185,210 @@ int cld_get_part(struct cld *c, int fd, const char *src)
 }
 
 /**
- * Download a file specified by its remote path @src
- * to the local path @dst.
- * Multipart files are supported.
+ * A local file written by a batch download.
+ */
+struct get_file {
+	int fd;			/**< The local file descriptor, or -1 */
+	int nr_names;		/**< The number of remote parts */
+	char **names;		/**< The remote part paths */
+};
+
+/**
+ * Add the download jobs of a remote file, split into ranged segments.
+ * @param jobs - the job array, grown as needed;
+ * @param nr_jobs - the number of jobs, updated;
+ * @param path - the remote path, kept by the jobs;
+ * @param flow - the flow of the file;
+ * @param fd - the local file descriptor;
+ * @param offset - the position of the file in the local file;
+ * @param size - the remote file size.
+ */
+static void add_segments(struct xfer_job **jobs, size_t *nr_jobs,
+			 const char *path, int flow, int fd, off_t offset,
+			 int64_t size)
+{
+	int64_t pos;
+
+	for (pos = 0; pos < size; pos += XFER_SEGMENT_SIZE) {
+		struct xfer_job *job;
+
+		*jobs = xrealloc(*jobs, (*nr_jobs + 1) * sizeof(**jobs));
+		job = &(*jobs)[(*nr_jobs)++];
+		xfer_job_init(job, XFER_GET, path);
+		job->flow = flow;
+		job->fd = fd;
+		job->local_offset = offset + pos;
+		job->remote_offset = pos;
+		job->length = size - pos < XFER_SEGMENT_SIZE
+			? size - pos
+			: XFER_SEGMENT_SIZE;
+		job->chunk.buf_size = DOWNLOAD_BUFFERSIZE;
+	}
+}
+
+/**
+ * Create a local file and add the download jobs of its remote parts.
  * @param c - the cloud client;
+ * @param gf - the local file descriptor to fill in;
  * @param src - the remote path;
- * @param dst -the local path.
+ * @param dst - the local path;
+ * @param flow - the flow of the file;
+ * @param jobs - the job array, grown as needed;
+ * @param nr_jobs - the number of jobs, updated.
  * @return 0 for success, or error code.
  */
-int cld_get(struct cld *c, const char *src, const char *dst)
+static int get_file_prepare(struct cld *c, struct get_file *gf,
+			    const char *src, const char *dst, int flow,
+			    struct xfer_job **jobs, size_t *nr_jobs)
 {
-	int res = 0;
-	int fd;
 	int nr_parts = cld_count_parts(c, src);
-	
+	off_t offset = 0;
+	int i;
+
 	if (nr_parts < 0)
 		return 1;
 	
-	if ((fd = creat(dst, 0644)) < 0) {
+	if ((gf->fd = creat(dst, 0644)) < 0) {
 		log_error("Could not open file to write\n");
 		return 1;
 	}
 	
-	if (nr_parts == 0) {
-		res = cld_get_part(c, fd, src);
-	} else {
-		int i;
-		for (i = 0; !res && i < nr_parts; i++) {
-			char *name = get_file_part_name(src, i);
-			res = cld_get_part(c, fd, name);
-			free(name);
+	gf->nr_names = nr_parts ? nr_parts : 1;
+	gf->names = xcalloc(gf->nr_names, sizeof(*gf->names));
+	for (i = 0; i < gf->nr_names; i++) {
+		struct file_list finfo = { 0 };
+		int res;
+
+		gf->names[i] = nr_parts ? get_file_part_name(src, i)
+					: xstrdup(src);
+		if (!(res = cld_file_stat(c, gf->names[i], &finfo))) {
+			add_segments(jobs, nr_jobs, gf->names[i], flow, gf->fd,
+				     offset, finfo.body.size);
+			offset += finfo.body.size;
+		}
+		cld_file_list_cleanup(&finfo);
+		if (res) {
+			log_error("Could not get size of %s\n", gf->names[i]);
+			return 1;
 		}
 	}
+	return 0;
+}
+
+/**
+ * Close a local file of a batch download.
+ * @param gf - the local file descriptor.
+ * @return 0 for success, or 1 if the file could not be closed.
+ */
+static int get_file_cleanup(struct get_file *gf)
+{
+	int res = 0;
+	int i;
 
-	if (close(fd)) {
+	for (i = 0; i < gf->nr_names; i++)
+		free(gf->names[i]);
+	free(gf->names);
+	if (gf->fd >= 0 && close(gf->fd)) {
 		log_error("Failed to close file\n");
 		res = 1;
 	}
+	return res;
+}
 
-	
+/**
+ * Download the parts of a remote file one by one.
+ * @param c - the cloud client;
+ * @param gf - the local file, written from the start.
+ * @return 0 for success, or error code.
+ */
+static int get_sequential(struct cld *c, struct get_file *gf)
+{
+	int res = 0;
+	int i;
+
+	if (ftruncate(gf->fd, 0) || lseek(gf->fd, 0, SEEK_SET) < 0) {
+		log_error("Could not truncate file\n");
+		return 1;
+	}
+	for (i = 0; !res && i < gf->nr_names; i++)
+		res = cld_get_part(c, gf->fd, gf->names[i]);
 	return res;
 }
+
+/**
+ * Check whether all download jobs of a file are done.
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs;
+ * @param flow - the flow of the file.
+ * @return true if the file is complete.
+ */
+static bool flow_done(const struct xfer_job *jobs, size_t nr_jobs, int flow)
+{
+	size_t i;
+	for (i = 0; i < nr_jobs; i++)
+		if (jobs[i].flow == flow && jobs[i].state != XFER_DONE)
+			return false;
+	return true;
+}
+
+/**
+ * Download remote files to local paths in one batch.
+ * Multipart files are supported. The files are split into ranged
+ * segments downloaded in parallel, the smaller files first, unless
+ * the server ignores ranges.
+ * @param c - the cloud client;
+ * @param src - the remote paths;
+ * @param dst - the local paths;
+ * @param nr_files - the number of files.
+ * @return 0 for success, or error code.
+ */
+int cld_get_files(struct cld *c, const char *const src[],
+		  const char *const dst[], size_t nr_files)
+{
+	int res = 0;
+	struct get_file *files = xcalloc(nr_files, sizeof(*files));
+	struct xfer_job *jobs = NULL;
+	size_t nr_jobs = 0, i;
+
+	for (i = 0; i < nr_files; i++)
+		files[i].fd = -1;
+	for (i = 0; !res && i < nr_files; i++)
+		res = get_file_prepare(c, &files[i], src[i], dst[i], i,
+				       &jobs, &nr_jobs);
+
+	if (!res)
+		res = cld_get_shard_info(c);
+	if (!res)
+		res = xfer_run(c, jobs, nr_jobs);
+	if (res == XFER_NO_RANGES) {
+		log_warn("Ranged downloads are not supported, "
+			 "downloading sequentially\n");
+		res = 0;
+		for (i = 0; !res && i < nr_files; i++)
+			if (!flow_done(jobs, nr_jobs, i))
+				res = get_sequential(c, &files[i]);
+	}
+
+	for (i = 0; i < nr_jobs; i++)
+		xfer_job_cleanup(&jobs[i]);
+	free(jobs);
+	for (i = 0; i < nr_files; i++)
+		if (get_file_cleanup(&files[i]))
+			res = 1;
+	free(files);
+	return res;
+}
+
+/**
+ * Download a file specified by its remote path @src
+ * to the local path @dst.
+ * Multipart files are supported.
+ * @param c - the cloud client;
+ * @param src - the remote path;
+ * @param dst -the local path.
+ * @return 0 for success, or error code.
+ */
+int cld_get(struct cld *c, const char *src, const char *dst)
+{
+	return cld_get_files(c, &src, &dst, 1);
+}
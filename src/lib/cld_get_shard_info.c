@@ -20,12 +20,17 @@
  */
 
 #include <malloc.h>
+#include <stddef.h>
 #include <string.h>
 #include <curl/curl.h>
 #include <claud/types.h>
 #include <claud/http_api.h>
 #include <claud/cld.h>
 #include <claud/jsmn_utils.h>
+#include <claud/shards.h>
+#include <claud/warmup.h>
+#include <claud/session.h>
+#include <claud/thread.h>
 #include <claud/utils.h>
 
 static void shard_item_cleanup(struct shard_item *item)
@@ -36,87 +41,85 @@ static void shard_item_cleanup(struct shard_item *item)
 	item->url = NULL;
 }
 
+static const struct json_field shard_item_fields[] = {
+	{ .name = "count", .type = JSON_STRING,
+	  .offset = offsetof(struct shard_item, count), .required = true },
+	{ .name = "url", .type = JSON_STRING,
+	  .offset = offsetof(struct shard_item, url), .required = true },
+};
+
 /**
- * @return 0 for success, or 1 for error
+ * Decode an array of shard items.
+ * @param js - the JSON code;
+ * @param t - the array;
+ * @param member - the shard item array to fill in;
+ * @param ctx - unused.
+ * @return 0 for success, or 1 for error.
  */
-static int parse_shard_item(const char *js, jsmntok_t *t, size_t count,
-			    struct shard_item *item)
+static int parse_shard_item_array(const char *js, jsmntok_t *t, void *member,
+				  void *ctx)
 {
-	item->count = get_json_string_by_name(js, t, count, "count");
-	if (!item->count)
-		return 1;
+	struct shard_item_array *arr = member;
+	struct json_decoder d;
+	jsmntok_t *item;
+	size_t i;
 
-	item->url = get_json_string_by_name(js, t, count, "url");
-	if (!item->url)
+	(void)ctx;
+	if (t->type != JSMN_ARRAY ||
+	    json_decoder_init(&d, shard_item_fields,
+			      ARRAY_SIZE(shard_item_fields)))
 		return 1;
 
-	return 0;
-}
-
-static int parse_shard_item_array_by_name(const char *js, jsmntok_t *tok,
-					  size_t count, const char *name,
-					  struct shard_item_array *arr)
-{
-	jsmntok_t *t, *item;
-	size_t i;
-	
-	t = find_json_element_by_name(js, tok, count, JSMN_ARRAY,
-						 name);
-	if (!t)
-		return 1;
-	
-	arr->items = calloc(t->size, sizeof(struct shard_item));
-	if (!arr->items) {
-		log_error("Could not alloc shard items");
-		return 1;
-	}
+	arr->items = xcalloc(t->size, sizeof(struct shard_item));
 	arr->size = t->size;
 	item = t + 1;
-	for (i = 0; i < t->size; i++) {
-		size_t cur_count = get_json_element_count(item);
-		if (parse_shard_item(js, item, cur_count, &arr->items[i])) {
-			log_error("Could not alloc shard items");
+	for (i = 0; i < arr->size; i++) {
+		if (json_decode_object(js, item, &d, &arr->items[i], NULL)) {
+			log_error("Wrongly formatted shard item\n");
 			return 1;
 		}
-		item += cur_count;
+		item += get_json_element_count(item);
 	}
 
 	return 0;
 }
 
+static const struct json_field shard_body_fields[] = {
+	{ .name = "upload", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct shard_info, body.upload), .required = true,
+	  .decode = parse_shard_item_array },
+	{ .name = "get", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct shard_info, body.get), .required = true,
+	  .decode = parse_shard_item_array },
+};
+
+static const struct json_field shard_info_fields[] = {
+	{ .name = "email", .type = JSON_STRING,
+	  .offset = offsetof(struct shard_info, email), .required = true },
+	{ .name = "time", .type = JSON_TIME,
+	  .offset = offsetof(struct shard_info, time) },
+	{ .name = "status", .type = JSON_INT,
+	  .offset = offsetof(struct shard_info, status) },
+	{ .name = "body", .type = JSON_OBJECT, .required = true,
+	  .fields = shard_body_fields,
+	  .nr_fields = ARRAY_SIZE(shard_body_fields) },
+};
+
 static int parse_shard_info(const char *js, jsmntok_t *tok, struct shard_info *s)
 {
-	jsmntok_t *body;
-	size_t count, body_count;
-	
-	count = get_json_element_count(tok);
+	struct json_decoder d;
 
-	if (!(s->email = get_json_string_by_name(js, tok, count, "email"))) {
-		log_error("Wrongly formatted shard info\n");
+	if (json_decoder_init(&d, shard_info_fields,
+			      ARRAY_SIZE(shard_info_fields)))
 		return 1;
-	}
-	s->time = (time_t)get_json_int64_by_name(js, tok, count, "time");
-	s->status = get_json_int_by_name(js, tok, count, "status");
-	body = find_json_element_by_name(js, tok, count, JSMN_OBJECT, "body");
-	if (!body) {
+	if (json_decode_object(js, tok, &d, s, NULL)) {
 		log_error("Wrongly formatted shard info\n");
 		return 1;
 	}
-	body_count = get_json_element_count(body);
-	if (parse_shard_item_array_by_name(js, body, body_count,
-		                           "upload", &s->body.upload)) {
-		log_error("Failed parsing 'upload' shard items\n");
-		return 1;
-	}
-	if (parse_shard_item_array_by_name(js, body, body_count,
-		                           "get", &s->body.get)) {
-		log_error("Failed parsing 'get' shard items\n");
-		return 1;
-	}
 	return 0;
 }
 
-static void shard_info_cleanup(struct shard_info *s)
+void shard_info_cleanup(struct shard_info *s)
 {
 	size_t i;
 	free(s->email);
@@ -126,57 +129,114 @@ static void shard_info_cleanup(struct shard_info *s)
 	for (i = 0; i < s->body.get.size; i++)
 		shard_item_cleanup(&s->body.get.items[i]);
 	free(s->body.get.items);
+	memset(s, 0, sizeof(*s));
 }
 
-int cld_get_shard_info(struct cld *c)
+/**
+ * Parse the dispatcher response.
+ * @param chunk - the response;
+ * @param s - the shard info structure to fill in.
+ * @return 0 for success, or 1 for error.
+ */
+int shard_info_parse(struct memory_struct *chunk, struct shard_info *s)
 {
 	int res;
 	jsmn_parser p;
 	jsmntok_t *tok = NULL;
 	size_t tokcount = 0;
-	struct memory_struct chunk;
 
-	struct shard_info s;
-	const char *p_names[1] = { "token"};
-	const char *p_values[1] = { c->auth_token };
-	char *url = make_url_with_params(c->curl, "dispatcher", p_names,
-					 p_values, 1);
-	if (!url)
+	/* Prepare parser */
+	jsmn_init(&p);
+
+	tok = parse_json(&p, chunk->memory, chunk->size, &tokcount);
+	if (!tok) {
+		log_error("Could not parse JSON\n");
+		log_error("%.*s\n", (int)chunk->size, chunk->memory);
 		return 1;
+	}
+	res = parse_shard_info(chunk->memory, tok, s);
+	if (!res && (!s->body.get.size || !s->body.upload.size)) {
+		log_error("No shards in the dispatcher response\n");
+		res = 1;
+	}
+	json_tokens_release(tok);
+	return res;
+}
+
+/**
+ * Build the dispatcher request with the specified token, so that
+ * the shard info may be fetched by a thread other than the session
+ * threads. The response is parsed with shard_info_parse().
+ * @param req - the request builder;
+ * @param token - the authentication token.
+ * @return 0 for success, or 1 for error.
+ */
+int shard_info_request(struct request *req, const char *token)
+{
+	const char *p_names[1] = { "token"};
+	const char *p_values[1] = { token };
+
+	request_url(req, URL_BASE, "dispatcher");
+	return request_add_params(req, p_names, p_values, 1);
+}
+
+/**
+ * Move all get and upload shards to the cloud descriptor.
+ * @param c - the cloud descriptor;
+ * @param s - the shard info.
+ */
+static void use_shard_info(struct cld *c, struct shard_info *s)
+{
+	shard_set_update(c->shards, s);
+	warmup_report_probes(c->warmup, c->shards);
+}
+
+/**
+ * Make sure the cloud descriptor knows the get and upload shards.
+ * The dispatcher response is cached for SHARD_CACHE_TTL_MS, or until
+ * a transfer fails because of a shard. When several threads find
+ * the cache expired, only one of them asks the dispatcher.
+ * @param c - the cloud descriptor.
+ * @return 0 for success, or error code.
+ */
+int cld_get_shard_info(struct cld *c)
+{
+	int res = 0;
+	struct memory_struct chunk;
+	struct shard_info s = { 0 };
+
+	if (shard_set_valid(c->shards))
+		return 0;
+
+	pthread_mutex_lock(&c->shards_lock);
+	if (shard_set_valid(c->shards))
+		goto out_unlock;
+
+	/* The session warm-up may have fetched the shards already */
+	if (!warmup_take_shards(c->warmup, &s)) {
+		use_shard_info(c, &s);
+		shard_info_cleanup(&s);
+		goto out_unlock;
+	}
+
+	request_url(cld_req(c), URL_BASE, "dispatcher");
 
 	memory_struct_init(&chunk);
-	res = get_req(c->curl, &chunk, url);
-	free(url);
+	res = api_get_req(c, &chunk);
 
 	if (res) {
 		log_error("Get failed\n");
-		memory_struct_cleanup(&chunk);
-		return res;
+		goto out_free_chunk;
 	}
 
-	/* Prepare parser */
-	jsmn_init(&p);
+	res = shard_info_parse(&chunk, &s);
+	if (!res)
+		use_shard_info(c, &s);
 
-	tok = parse_json(&p, chunk.memory, chunk.size, &tokcount);
-	if (!tok) {
-		log_error("Could not parse JSON\n");
-		chunk.memory[chunk.size - 1] = 0;
-		log_error("%s\n", chunk.memory);
-		res = 1;
-	} else {
-		res = parse_shard_info(chunk.memory, tok, &s);
-		if (!res) {
-			/* Move Get and Upload to c */
-			free(c->shard.get);
-			c->shard.get = s.body.get.items[0].url;
-			s.body.get.items[0].url = NULL;
-			free(c->shard.upload);
-			c->shard.upload = s.body.upload.items[0].url;
-			s.body.upload.items[0].url = NULL;
-		}
-		free(tok);
-	}
 	shard_info_cleanup(&s);
+out_free_chunk:
 	memory_struct_cleanup(&chunk);
+out_unlock:
+	pthread_mutex_unlock(&c->shards_lock);
 	return res;
 }
@@ -0,0 +1,184 @@
+/**
+ * @file cld_hedge.c
+ * Implementation of hedged requests for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+#include <claud/cld.h>
+#include <claud/conn_pool.h>
+#include <claud/hedge.h>
+#include <claud/mem_budget.h>
+#include <claud/thread.h>
+#include <claud/utils.h>
+
+/**
+ * Initialize the hedging policy with the defaults. Hedging is disabled.
+ * @param h - the hedging policy.
+ */
+void hedge_init(struct hedge *h)
+{
+	memset(h, 0, sizeof(*h));
+	pthread_mutex_init(&h->lock, NULL);
+	h->percentile = HEDGE_DEFAULT_PERCENTILE;
+	h->budget = HEDGE_DEFAULT_BUDGET;
+	h->credit = 100;
+}
+
+void hedge_cleanup(struct hedge *h)
+{
+	pthread_mutex_destroy(&h->lock);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Compute the delay after which a request is hedged.
+ * @param h - the hedging policy.
+ * @return the delay in milliseconds.
+ */
+static long hedge_delay(const struct hedge *h)
+{
+	long sorted[HEDGE_WINDOW];
+	size_t idx;
+
+	if (h->nr_samples < HEDGE_MIN_SAMPLES)
+		return HEDGE_DEFAULT_DELAY_MS;
+
+	memcpy(sorted, h->latency, h->nr_samples * sizeof(*sorted));
+	qsort(sorted, h->nr_samples, sizeof(*sorted), compare_long);
+	idx = (h->nr_samples * h->percentile) / 100;
+	if (idx >= h->nr_samples)
+		idx = h->nr_samples - 1;
+
+	return sorted[idx] > HEDGE_MIN_DELAY_MS
+		? sorted[idx]
+		: HEDGE_MIN_DELAY_MS;
+}
+
+static void hedge_record(struct hedge *h, long latency)
+{
+	h->latency[h->next] = latency;
+	h->next = (h->next + 1) % HEDGE_WINDOW;
+	if (h->nr_samples < HEDGE_WINDOW)
+		h->nr_samples++;
+}
+
+/**
+ * Earn budget credit for a request and check whether
+ * it can be hedged.
+ * @param h - the hedging policy.
+ * @return true if there is enough credit for a hedge.
+ */
+static bool hedge_allowed(struct hedge *h)
+{
+	h->nr_requests++;
+	h->credit += h->budget;
+	if (h->credit > 100 * HEDGE_MAX_BURST)
+		h->credit = 100 * HEDGE_MAX_BURST;
+	return h->credit >= 100;
+}
+
+/**
+ * Perform an idempotent GET request, hedging it on another pooled
+ * connection when it is slower than the configured latency percentile.
+ * @param c - the cloud descriptor;
+ * @param chunk - the memory structure receiving the response;
+ * @param url - the request URL.
+ * @return 0 for success, or 1 for error.
+ */
+int hedged_get_req(struct cld *c, struct memory_struct *chunk,
+		   const char *url)
+{
+	int res;
+	bool hedged = false, allowed;
+	CURLM *multi;
+	CURL *backup = NULL;
+	struct hedge *h = c->hedge;
+	int64_t start = get_time_ms();
+	long delay;
+
+	/* A consumed response can not be taken back for the other one */
+	if (chunk->sink)
+		return get_req(cld_curl(c), chunk, url);
+
+	pthread_mutex_lock(&h->lock);
+	if (!h->enabled) {
+		pthread_mutex_unlock(&h->lock);
+		return get_req(cld_curl(c), chunk, url);
+	}
+	allowed = hedge_allowed(h);
+	delay = hedge_delay(h);
+	pthread_mutex_unlock(&h->lock);
+
+	if (!(multi = cld_multi(c)))
+		return get_req(cld_curl(c), chunk, url);
+	if (allowed && (backup = conn_pool_acquire(c->pool, CONN_METADATA)))
+		mem_budget_charge(c->budget, http_req_buffers(chunk, false));
+
+	res = get_req_hedged(multi, cld_curl(c), backup, chunk, url, delay,
+			     &hedged);
+	if (backup) {
+		mem_budget_release(c->budget, http_req_buffers(chunk, false));
+		conn_pool_release(c->pool, backup);
+	}
+
+	pthread_mutex_lock(&h->lock);
+	if (hedged) {
+		h->credit -= 100;
+		h->nr_hedges++;
+	}
+	if (!res)
+		hedge_record(h, (long)(get_time_ms() - start));
+	pthread_mutex_unlock(&h->lock);
+
+	return res;
+}
+
+/**
+ * Configure hedging of idempotent metadata requests.
+ * @param c - the cloud descriptor;
+ * @param enabled - whether hedging is enabled;
+ * @param percentile - the latency percentile used as the hedging delay,
+ * 1 to 99, or 0 for the default;
+ * @param budget - the number of hedges allowed per 100 requests,
+ * 1 to 100, or 0 for the default.
+ * @return 0 for success, or 1 for wrong parameters.
+ */
+int cld_set_hedging(struct cld *c, bool enabled, int percentile, int budget)
+{
+	if (percentile < 0 || percentile > 99 || budget < 0 || budget > 100) {
+		log_error("Wrong hedging parameters\n");
+		return 1;
+	}
+	pthread_mutex_lock(&c->hedge->lock);
+	c->hedge->enabled = enabled;
+	c->hedge->percentile = percentile ? percentile : HEDGE_DEFAULT_PERCENTILE;
+	c->hedge->budget = budget ? budget : HEDGE_DEFAULT_BUDGET;
+	pthread_mutex_unlock(&c->hedge->lock);
+	return 0;
+}
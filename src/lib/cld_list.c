@@ -26,166 +26,431 @@
 #include <time.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <regex.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <claud/types.h>
 #include <claud/http_api.h>
 #include <claud/cld.h>
 #include <claud/jsmn_utils.h>
+#include <claud/json_stream.h>
+#include <claud/session.h>
+#include <claud/thread.h>
 #include <claud/utils.h>
 
+/** Initial number of entries allocated for a directory listing */
+#define LIST_INIT_ITEMS 64
+/** Number of entries requested at once by cld_iterate_file_list() */
+#define LIST_PAGE_ITEMS 1000
+
 static int handle_compounds(struct file_list *contents);
+static regex_t *part_regex(void);
+static char *get_part_basename(regex_t *re, const char *name);
+static void list_item_cleanup(struct list_item *li);
+
+/** Keys leading to the entries of a directory listing */
+static const char *const list_path[] = { "body", "list" };
 
 /**
- * Parse the JSON-encoded directory entry description to
- * the specified list_item structure.
+ * Decode the kind of an entry. Kinds that are not known are decoded
+ * as KIND_UNKNOWN.
  * @param js - the JSON code;
- * @param tok - the JSON element of the directory entry;
- * @param count - the number of elements in the JSON subtree;
- * @param li - a pointer to the list_item struture.
+ * @param t - the string token;
+ * @param member - the enum item_kind to set;
+ * @param ctx - unused.
+ * @return 0 for success, or 1 if the token is not a string.
  */
-static void parse_list_item(const char *js, jsmntok_t *tok, size_t count,
-			    struct list_item *li)
+static int decode_item_kind(const char *js, jsmntok_t *t, void *member,
+			    void *ctx)
 {
-	li->mtime = (time_t)get_json_int64_by_name(js, tok, count, "mtime");
-	li->kind = get_json_string_by_name(js, tok, count, "kind");
-	li->size = get_json_int64_by_name(js, tok, count, "size");
-	li->name = get_json_string_by_name(js, tok, count, "name");
-	li->hash = get_json_string_by_name(js, tok, count, "hash");
+	enum item_kind *kind = member;
+	size_t len = t->end - t->start;
+
+	(void)ctx;
+	if (t->type != JSMN_STRING)
+		return 1;
+	if (len == 4 && !memcmp(js + t->start, "file", 4))
+		*kind = KIND_FILE;
+	else if (len == 6 && !memcmp(js + t->start, "folder", 6))
+		*kind = KIND_FOLDER;
+	else
+		*kind = KIND_UNKNOWN;
+	return 0;
 }
 
 /**
- * Parse the JSON-encoded contents of a mail.ru cloud directory to
- * the specified file_list structure.
+ * Copy a JSON string to a string pool.
  * @param js - the JSON code;
- * @param tok - the root JSON element;
- * @param finfo - a pointer to the file_list struture.
- * @return 0 for success, or error code.
+ * @param t - the string token;
+ * @param member - the uint32_t receiving the offset in the pool;
+ * @param ctx - the pool.
+ * @return 0 for success, or 1 if the token is not a string.
  */
-static int parse_file_list(const char *js, jsmntok_t *tok,
-			   struct file_list *finfo, bool raw)
+static int decode_pool_string(const char *js, jsmntok_t *t, void *member,
+			      void *ctx)
 {
-	jsmntok_t *body, *list, *t;
-	size_t count, body_count;
-	size_t i;
-	
-	count = get_json_element_count(tok);
-	body = find_json_element_by_name(js, tok, count, JSMN_OBJECT, "body");
-	if (!body) {
-		log_error("Wrongly formatted file list info: no body\n");
+	if (t->type != JSMN_STRING)
 		return 1;
-	}
-	body_count = get_json_element_count(body);
-	list = find_json_element_by_name(js, tok, count, JSMN_ARRAY, "list");
-	if (!list) {
-		log_error("Wrongly formatted file list info: no list\n");
+	*(uint32_t *)member = str_pool_add(ctx, js + t->start,
+					   t->end - t->start);
+	return 0;
+}
+
+/**
+ * Copy a JSON string to an arena.
+ * @param js - the JSON code;
+ * @param t - the string token;
+ * @param member - the char * receiving the copy;
+ * @param ctx - the arena.
+ * @return 0 for success, or 1 if the token is not a string.
+ */
+static int decode_arena_string(const char *js, jsmntok_t *t, void *member,
+			       void *ctx)
+{
+	if (t->type != JSMN_STRING)
 		return 1;
-	}
-	finfo->body.list = calloc(list->size, sizeof(struct list_item));
-	if (!finfo->body.list) {
-		log_error("Failed to allocate a list of %d elements\n",
-			list->size);
+	*(char **)member = parse_json_arena_string(js, t, ctx);
+	return 0;
+}
+
+/** Fields of a directory entry, the strings go to the list pool */
+static const struct json_field list_item_fields[] = {
+	{ .name = "mtime", .type = JSON_TIME,
+	  .offset = offsetof(struct list_item, mtime) },
+	{ .name = "kind", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct list_item, kind),
+	  .decode = decode_item_kind },
+	{ .name = "size", .type = JSON_INT64,
+	  .offset = offsetof(struct list_item, size) },
+	{ .name = "name", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct list_item, name),
+	  .decode = decode_pool_string },
+	{ .name = "hash", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct list_item, hash),
+	  .decode = decode_pool_string },
+	{ .name = "type", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct list_item, type),
+	  .decode = decode_item_kind },
+};
+
+/** Fields of a file or directory info, the strings go to the arena */
+static const struct json_field file_body_fields[] = {
+	{ .name = "mtime", .type = JSON_TIME,
+	  .offset = offsetof(struct file_list, body.mtime) },
+	{ .name = "kind", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct file_list, body.kind),
+	  .decode = decode_item_kind },
+	{ .name = "size", .type = JSON_INT64,
+	  .offset = offsetof(struct file_list, body.size) },
+	{ .name = "name", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct file_list, body.name),
+	  .decode = decode_arena_string },
+	{ .name = "hash", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct file_list, body.hash),
+	  .decode = decode_arena_string },
+	{ .name = "type", .type = JSON_CUSTOM,
+	  .offset = offsetof(struct file_list, body.type),
+	  .decode = decode_arena_string },
+};
+
+static const struct json_field file_stat_fields[] = {
+	{ .name = "body", .type = JSON_OBJECT, .required = true,
+	  .fields = file_body_fields,
+	  .nr_fields = ARRAY_SIZE(file_body_fields) },
+};
+
+/**
+ * Decoder of a directory listing fed with the response as it
+ * is received, so that the entries are decoded while the rest
+ * of the listing is still on the way.
+ */
+struct list_decoder {
+	struct json_stream stream;	/**< Splitter of the listing entries */
+	struct response_sink sink;	/**< The response consumer */
+	struct json_decoder items;	/**< The entry decoder */
+	struct file_list *finfo;	/**< The directory contents */
+	size_t nr_alloc;		/**< Entries allocated in the list */
+};
+
+/**
+ * Decode a directory entry received by the decoder.
+ * @param arg - the list decoder;
+ * @param js - the JSON code of the entry;
+ * @param len - the code length.
+ * @return 0 for success, or 1 for error.
+ */
+static int list_decoder_item(void *arg, const char *js, size_t len)
+{
+	struct list_decoder *d = arg;
+	struct file_list *finfo = d->finfo;
+	struct list_item *li;
+	jsmn_parser p;
+	jsmntok_t *tok;
+	size_t count;
+
+	jsmn_init(&p);
+	tok = parse_json(&p, js, len, &count);
+	if (!tok) {
+		log_error("Could not parse JSON\n");
+		log_error("%.*s\n", (int)len, js);
 		return 1;
 	}
-	
-	finfo->body.nr_list_items = list->size;
-	t = list + 1;
-	for (i = 0; i < list->size; i++) {
-		size_t count = get_json_element_count(t);
-		parse_list_item(js, t, count, &finfo->body.list[i]);
-		t += count;
+	if (finfo->body.nr_list_items == d->nr_alloc) {
+		d->nr_alloc = d->nr_alloc ? 2 * d->nr_alloc : LIST_INIT_ITEMS;
+		finfo->body.list = xrealloc(finfo->body.list,
+			d->nr_alloc * sizeof(*finfo->body.list));
 	}
-
-	if (!raw)
-		handle_compounds(finfo);
-	
+	li = &finfo->body.list[finfo->body.nr_list_items++];
+	memset(li, 0, sizeof(*li));
+	json_decode_object(js, tok, &d->items, li, &finfo->pool);
+	json_tokens_release(tok);
 	return 0;
 }
 
 /**
- * Read the contents of a mail.ru cloud directory to the specified
- * file_list structure.
+ * Drop the entries decoded from a previous response.
+ * @param arg - the list decoder.
+ */
+static void list_decoder_start(void *arg)
+{
+	struct list_decoder *d = arg;
+
+	str_pool_release(&d->finfo->pool);
+	d->finfo->body.nr_list_items = 0;
+	json_stream_reset(&d->stream);
+}
+
+static int list_decoder_write(void *arg, const char *data, size_t size)
+{
+	struct list_decoder *d = arg;
+	return json_stream_feed(&d->stream, data, size);
+}
+
+static void list_decoder_init(struct list_decoder *d, struct file_list *finfo)
+{
+	json_stream_init(&d->stream, list_path, ARRAY_SIZE(list_path),
+			 list_decoder_item, d);
+	json_decoder_init(&d->items, list_item_fields,
+			  ARRAY_SIZE(list_item_fields));
+	d->sink.start = list_decoder_start;
+	d->sink.write = list_decoder_write;
+	d->sink.arg = d;
+	d->finfo = finfo;
+	d->nr_alloc = 0;
+}
+
+/**
+ * Request a directory listing and decode its entries with the decoder.
  * @param c - the cloud descriptor;
  * @param path - the directory path;
- * @param finfo - a pointer to the file_list structure.
- * @param raw - if true, do not join compound file items.
+ * @param offset - the number of entries to skip;
+ * @param limit - the maximum number of entries, 0 for the whole listing;
+ * @param d - the list decoder.
  * @result 0 for success, or error code.
  */
-int cld_get_file_list(struct cld *c, const char *path, struct file_list *finfo,
-		      bool raw)
+static int fetch_file_list(struct cld *c, const char *path, size_t offset,
+			   size_t limit, struct list_decoder *d)
 {
 	int res;
-	jsmn_parser p;
-	jsmntok_t *tok = NULL;
-	size_t tokcount = 0;
 	struct memory_struct chunk;
+	char offset_str[24], limit_str[24];
 
-	const char *p_names[] = { "home", "token" };
-	const char *p_values[] = { path, c->auth_token };
-	char *url = make_url_with_params(c->curl, "folder", p_names, p_values, ARRAY_SIZE(p_names));
-	
-	if (!url)
+	const char *p_names[] = { "home", "offset", "limit" };
+	const char *p_values[] = { path, offset_str, limit_str };
+	struct request *req = cld_req(c);
+
+	snprintf(offset_str, sizeof(offset_str), "%zu", offset);
+	snprintf(limit_str, sizeof(limit_str), "%zu", limit);
+	request_url(req, URL_BASE, "folder");
+	if (request_add_params(req, p_names, p_values,
+			       limit ? ARRAY_SIZE(p_names) : 1))
 		return 1;
 
 	memory_struct_init(&chunk);
-	res = get_req(c->curl, &chunk, url);
-	free(url);
-	
+	chunk.sink = &d->sink;
+	res = api_get_req(c, &chunk);
+
 	if (res) {
 		log_error("Get failed\n");
-		return res;
-	}
-
-	/* Prepare parser */
-	jsmn_init(&p);
-
-	tok = parse_json(&p, chunk.memory, chunk.size, &tokcount);
-	if (!tok) {
-		log_error("Could not parse JSON\n");
-		chunk.memory[chunk.size - 1] = 0;
-		log_error("%s\n", chunk.memory);
+	} else if (json_stream_finish(&d->stream)) {
+		log_error("Wrongly formatted file list info\n");
 		res = 1;
-	} else {
-		res = parse_file_list(chunk.memory, tok, finfo, raw);
 	}
-	
-	free(tok);
 	memory_struct_cleanup(&chunk);
 	return res;
 }
 
 /**
- * Clean up a list_item structure.
+ * Read the contents of a mail.ru cloud directory to the specified
+ * file_list structure. The listing is decoded entry by entry as it
+ * is received, neither the whole response nor its JSON tokens are
+ * kept in memory.
+ * @param c - the cloud descriptor;
+ * @param path - the directory path;
+ * @param finfo - a pointer to the file_list structure.
+ * @param raw - if true, do not join compound file items.
+ * @result 0 for success, or error code.
+ */
+int cld_get_file_list(struct cld *c, const char *path, struct file_list *finfo,
+		      bool raw)
+{
+	int res;
+	struct list_decoder d;
+
+	list_decoder_init(&d, finfo);
+	res = fetch_file_list(c, path, 0, 0, &d);
+	if (!res && !raw)
+		handle_compounds(finfo);
+
+	if (res)
+		cld_file_list_cleanup(finfo);
+	json_stream_cleanup(&d.stream);
+	return res;
+}
+
+/**
+ * Start the pending compound file with its first part.
+ * @param cp - the pending compound, with its name in its own pool;
+ * @param page - the listing page of the part;
+ * @param li - the part;
+ * @param name - the compound name.
+ */
+static void start_compound(struct file_list *cp, const struct file_list *page,
+			   const struct list_item *li, const char *name)
+{
+	struct list_item *item;
+	const char *hash;
+
+	if (!cp->body.list)
+		cp->body.list = xmalloc(sizeof(*cp->body.list));
+	str_pool_release(&cp->pool);
+	item = cp->body.list;
+	*item = *li;
+	item->name = str_pool_add(&cp->pool, name, strlen(name));
+	if ((hash = list_item_hash(page, li)))
+		item->hash = str_pool_add(&cp->pool, hash, strlen(hash));
+	cp->body.nr_list_items = 1;
+}
+
+/**
+ * Pass the pending compound file to the callback, if there is one.
+ * @param cp - the pending compound, emptied;
+ * @param iter - the callback;
+ * @param arg - the callback argument.
+ * @result 0 or the value returned by the callback.
+ */
+static int pass_compound(struct file_list *cp, cld_list_iter iter, void *arg)
+{
+	if (!cp->body.nr_list_items)
+		return 0;
+	cp->body.nr_list_items = 0;
+	return iter(arg, cp, cp->body.list);
+}
+
+/**
+ * Pass the entries of a mail.ru cloud directory to a callback. The
+ * listing is requested in pages of LIST_PAGE_ITEMS entries until
+ * an empty page comes, as the server may return fewer entries than
+ * asked for. Only the current page is kept in memory, so that folders
+ * of any size are listed in bounded memory. Unless raw is set, the
+ * parts of compound files are collapsed into single entries. The
+ * server lists the parts of a compound one after another, so only
+ * the compound being collected is kept, and it is passed at the
+ * position of its first part once its last part is seen. A part
+ * listed apart from the others of its compound is passed as another
+ * compound of the same name.
+ * @param c - the cloud descriptor;
+ * @param path - the directory path;
+ * @param raw - if true, do not join compound file items;
+ * @param iter - the callback;
+ * @param arg - the callback argument.
+ * @result 0 for success, the nonzero value returned by the callback,
+ * or 1 for error.
+ */
+int cld_iterate_file_list(struct cld *c, const char *path, bool raw,
+			  cld_list_iter iter, void *arg)
+{
+	struct file_list page = { 0 };
+	struct file_list cp = { 0 };	/* The compound being collected */
+	struct list_decoder d;
+	size_t offset = 0;
+	size_t i;
+	regex_t *re = NULL;
+	int res = 0;
+
+	if (!raw && !(re = part_regex()))
+		return 1;
+
+	list_decoder_init(&d, &page);
+	do {
+		if (fetch_file_list(c, path, offset, LIST_PAGE_ITEMS, &d)) {
+			res = 1;
+			break;
+		}
+		for (i = 0; i < page.body.nr_list_items && !res; i++) {
+			struct list_item *li = &page.body.list[i];
+			char *name = list_item_name(&page, li);
+
+			if (re && name)
+				name = get_part_basename(re, name);
+			else
+				name = NULL;
+			if (!name) {
+				res = pass_compound(&cp, iter, arg);
+				if (!res)
+					res = iter(arg, &page, li);
+				continue;
+			}
+
+			if (cp.body.nr_list_items &&
+			    !strcmp(name, list_item_name(&cp, cp.body.list))) {
+				cp.body.list->size += li->size;
+			} else {
+				res = pass_compound(&cp, iter, arg);
+				start_compound(&cp, &page, li, name);
+			}
+			free(name);
+		}
+		offset += page.body.nr_list_items;
+	} while (!res && page.body.nr_list_items);
+
+	if (!res)
+		res = pass_compound(&cp, iter, arg);
+
+	json_stream_cleanup(&d.stream);
+	cld_file_list_cleanup(&page);
+	cld_file_list_cleanup(&cp);
+	return res;
+}
+
+/**
+ * Clean up a list_item structure. Its strings stay in the pool
+ * of the list until the whole list is cleaned up.
  * @param li - a pointer to the list_item struture.
  */
 static void list_item_cleanup(struct list_item *li)
 {
-	free(li->kind);
-	free(li->hash);
-	free(li->name);
 	memset(li, 0, sizeof(*li));
 }
 
 /**
- * Clean up a file_list structure.
+ * Clean up a file_list structure. All the strings of the list
+ * are freed at once with its arena and string pool.
  * @param finfo - a pointer to the file_list struture.
  */
 void cld_file_list_cleanup(struct file_list *finfo)
 {
-	size_t i;
 	if (!finfo)
 		return;
-	free(finfo->body.kind);
-	free(finfo->body.hash);
-	free(finfo->body.name);
-	for (i = 0; i < finfo->body.nr_list_items; i++)
-		list_item_cleanup(&finfo->body.list[i]);
 	free(finfo->body.list);
+	arena_release(&finfo->arena);
+	str_pool_release(&finfo->pool);
 	memset(finfo, 0, sizeof(*finfo));
 }
 
@@ -199,21 +464,13 @@ void cld_file_list_cleanup(struct file_list *finfo)
  */
 static int parse_file_stat(const char *js, jsmntok_t *tok, struct file_list *finfo)
 {
-	jsmntok_t *body;
-	size_t count, body_count;
-	
-	count = get_json_element_count(tok);
-	body = find_json_element_by_name(js, tok, count, JSMN_OBJECT, "body");
-	if (!body) {
+	struct json_decoder d;
+
+	json_decoder_init(&d, file_stat_fields, ARRAY_SIZE(file_stat_fields));
+	if (json_decode_object(js, tok, &d, finfo, &finfo->arena)) {
 		log_error("Wrongly formatted file info\n");
 		return 1;
 	}
-	body_count = get_json_element_count(body);
-	finfo->body.mtime = (time_t)get_json_int64_by_name(js, body, body_count, "mtime");
-	finfo->body.kind = get_json_string_by_name(js, tok, count, "kind");
-	finfo->body.size = get_json_int64_by_name(js, body, body_count, "size");
-	finfo->body.name = get_json_string_by_name(js, tok, count, "name");
-	finfo->body.hash = get_json_string_by_name(js, tok, count, "hash");
 	return 0;
 }
 
@@ -233,16 +490,16 @@ int cld_file_stat(struct cld *c, const char *path, struct file_list *finfo)
 	size_t tokcount = 0;
 	struct memory_struct chunk;
 
-	const char *p_names[] = { "home", "token" };
-	const char *p_values[] = { path, c->auth_token };
-	char *url = make_url_with_params(c->curl, "file", p_names, p_values, ARRAY_SIZE(p_names));
-	
-	if (!url)
+	const char *p_names[] = { "home" };
+	const char *p_values[] = { path };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file");
+	if (request_add_params(req, p_names, p_values, ARRAY_SIZE(p_names)))
 		return 1;
 
 	memory_struct_init(&chunk);
-	res = get_req(c->curl, &chunk, url);
-	free(url);
+	res = api_get_req(c, &chunk);
 	
 	if (res) {
 		log_error("Get failed\n");
@@ -255,14 +512,13 @@ int cld_file_stat(struct cld *c, const char *path, struct file_list *finfo)
 	tok = parse_json(&p, chunk.memory, chunk.size, &tokcount);
 	if (!tok) {
 		log_error("Could not parse JSON\n");
-		chunk.memory[chunk.size - 1] = 0;
-		log_error("%s\n", chunk.memory);
+		log_error("%.*s\n", (int)chunk.size, chunk.memory);
 		res = 1;
 	} else {
 		res = parse_file_stat(chunk.memory, tok, finfo);
 	}
 	
-	free(tok);
+	json_tokens_release(tok);
 	memory_struct_cleanup(&chunk);
 	return res;
 }
@@ -294,6 +550,30 @@ static int compress_file_list(struct list_item *list, size_t nr_items)
 	return non_empty_count;
 }
 
+/** The part name regex, compiled once and shared by all threads */
+static regex_t part_re;
+static bool part_re_valid;
+static pthread_once_t part_re_once = PTHREAD_ONCE_INIT;
+
+static void compile_part_regex(void)
+{
+	part_re_valid = !regcomp(&part_re, PART_REGEX, REG_EXTENDED);
+}
+
+/**
+ * Get the compiled part name regex.
+ * @return the regex, or NULL if it failed to compile.
+ */
+static regex_t *part_regex(void)
+{
+	pthread_once(&part_re_once, compile_part_regex);
+	if (!part_re_valid) {
+		log_error("Failed to compile regex\n");
+		return NULL;
+	}
+	return &part_re;
+}
+
 static char *get_part_basename(regex_t *re, const char *name)
 {
 	regmatch_t m[4];
@@ -304,19 +584,21 @@ static char *get_part_basename(regex_t *re, const char *name)
 		: NULL;
 }
 
-static void add_to_compounds(struct list_item *item, const char *name,
+static void add_to_compounds(const struct file_list *contents,
+			     struct list_item *item, const char *name,
 			     struct list_item **compounds, size_t *nr_compounds)
 {
 	size_t j;
 
 	/* Look for list item in compounds */
 	for (j = 0; j < *nr_compounds; j++)
-		if (!strcmp(name, compounds[j]->name))
+		if (!strcmp(name, list_item_name(contents, compounds[j])))
 			break;
 
 	if (j == *nr_compounds) { /* Not found - a new compound */
 		compounds[j] = item;
-		strcpy(compounds[j]->name, name);
+		/* The base name is shorter, it fits in place */
+		strcpy(list_item_name(contents, compounds[j]), name);
 		(*nr_compounds)++;
 	} else { /* Found - add size and remove from list */
 		compounds[j]->size += item->size;
@@ -348,23 +630,21 @@ static int handle_compounds(struct file_list *contents)
 	size_t *nr_items_ptr = &contents->body.nr_list_items;
 	size_t nr_items = *nr_items_ptr;
 	struct list_item *list = contents->body.list;
-	regex_t re;
+	regex_t *re = part_regex();
 	struct list_item **compounds = NULL; // Array of ptrs to compound list items
 	size_t nr_compounds = 0;
 	size_t i;
 
-	compounds = xcalloc(nr_items, sizeof(*compounds));
-	
-	if (regcomp(&re, PART_REGEX, REG_EXTENDED)) {
-		log_error("Failed to compile regex\n");
-		free(compounds);
+	if (!re)
 		return 1;
-	}
+
+	compounds = xcalloc(nr_items, sizeof(*compounds));
 	
 	for (i = 0; i < nr_items; i++) {
-		char *name = get_part_basename(&re, list[i].name);
+		char *name = get_part_basename(re,
+				list_item_name(contents, &list[i]));
 		if (name) {
-			add_to_compounds(&list[i], name, compounds,
+			add_to_compounds(contents, &list[i], name, compounds,
 					 &nr_compounds);
 			free(name);
 		}
@@ -373,7 +653,7 @@ static int handle_compounds(struct file_list *contents)
 	*nr_items_ptr = compress_file_list(list, nr_items);
 	
 	free(compounds);
-	regfree(&re);
+	return 0;
 }
 
 /**
@@ -415,7 +695,7 @@ int cld_count_parts(struct cld *c, const char *path)
 	size_t baselen = strlen(basename);
 	size_t nr_items;
 	struct list_item *list;
-	regex_t re;
+	regex_t *re;
 	char *parts = NULL;
 	int i;
 	
@@ -430,16 +710,15 @@ int cld_count_parts(struct cld *c, const char *path)
 	list = finfo.body.list;
 	parts = xcalloc(nr_items, sizeof(*parts));
 	
-	if (regcomp(&re, PART_REGEX, REG_EXTENDED)) {
-		log_error("Failed to compile regex\n");
+	if (!(re = part_regex())) {
 		res = -EFAULT;
 		goto out_free_parts;
 	}
 
 	for (i = 0; i < nr_items; i++) {
 		int idx;
-		char *name = list[i].name;
-		if(!strcmp(list[i].kind, "folder"))
+		char *name = list_item_name(&finfo, &list[i]);
+		if (list[i].kind == KIND_FOLDER || !name)
 			continue;
 		
 		/* Check for single part */
@@ -450,7 +729,7 @@ int cld_count_parts(struct cld *c, const char *path)
 		}
 		
 		/* Check for multiple parts */
-		idx = get_part_number(&re, basename, baselen, name);
+		idx = get_part_number(re, basename, baselen, name);
 		if (idx >=0 && idx < nr_items) {
 			parts[idx] = 1;
 			if (idx == 0)
@@ -461,8 +740,6 @@ int cld_count_parts(struct cld *c, const char *path)
 	if (res == 0 && is_mpart)
 		while (res < nr_items && parts[res]) res++;
 
-	regfree(&re);
-	
 out_free_parts:
 	free(parts);
 	cld_file_list_cleanup(&finfo);
@@ -0,0 +1,654 @@
+/**
+ * @file cld_session.c
+ * Session cache and authenticated requests for Mail.Ru Cloud access library.
+ *
+ * The cookies and the token of a session are kept in per-user files,
+ * so that the next process can use the session without logging in.
+ * A cached session is validated lazily. When the server rejects an
+ * API request, the token is renewed with the session cookies and the
+ * request is repeated. Only if that does not help, the library logs
+ * in again.
+ *
+ * With libcurl 8.12 or newer, the TLS session tickets are cached too,
+ * so that the next process resumes the TLS sessions to the hosts.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+#include <claud/cld.h>
+#include <claud/hedge.h>
+#include <claud/mem_budget.h>
+#include <claud/session.h>
+#include <claud/thread.h>
+#include <claud/utils.h>
+
+#define LOGIN_URL "https://auth.mail.ru/cgi-bin/auth"
+#define SDC_URL "https://auth.mail.ru/sdc?from=https://cloud.mail.ru/home"
+#define TOKEN_URL URL_BASE "tokens/csrf"
+
+/**
+ * Create a directory accessible only by the user, unless it exists.
+ * @param path - the directory path.
+ * @return 0 for success, or 1 for error.
+ */
+static int make_private_dir(const char *path)
+{
+	if (mkdir(path, 0700) && errno != EEXIST) {
+		log_warn("Could not create %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Make up the path of the session cache directory, creating it
+ * if needed: $XDG_CACHE_HOME/claud, or ~/.cache/claud.
+ * @return the allocated path, or NULL if there is no cache directory.
+ */
+static char *make_cache_dir(void)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char *dir;
+
+	if (xdg && *xdg) {
+		dir = xmalloc(strlen(xdg) + strlen(SESSION_CACHE_DIR) + 2);
+		sprintf(dir, "%s/%s", xdg, SESSION_CACHE_DIR);
+		make_private_dir(xdg);
+	} else if (home && *home) {
+		dir = xmalloc(strlen(home) + strlen(SESSION_CACHE_DIR) + 10);
+		sprintf(dir, "%s/.cache", home);
+		make_private_dir(dir);
+		sprintf(dir, "%s/.cache/%s", home, SESSION_CACHE_DIR);
+	} else {
+		return NULL;
+	}
+
+	if (make_private_dir(dir)) {
+		free(dir);
+		return NULL;
+	}
+	/* The directory may have been created by an older version */
+	chmod(dir, 0700);
+	return dir;
+}
+
+/**
+ * Make up the path of a session cache file.
+ * @param dir - the cache directory;
+ * @param user - the user name;
+ * @param domain - the user domain;
+ * @param suffix - the file name suffix.
+ * @return the allocated path.
+ */
+static char *make_cache_path(const char *dir, const char *user,
+			     const char *domain, const char *suffix)
+{
+	char *path = xmalloc(strlen(dir) + strlen(user) + strlen(domain) +
+			     strlen(suffix) + 3);
+	char *name = path + strlen(dir) + 1;
+
+	sprintf(path, "%s/%s@%s%s", dir, user, domain, suffix);
+	for (; *name; name++)
+		if (*name == '/')
+			*name = '_';
+	return path;
+}
+
+/**
+ * Open a session cache file for writing. The file is created
+ * accessible only by the user.
+ * @param path - the file path;
+ * @param flags - extra open flags.
+ * @return the file descriptor, or -1 for error.
+ */
+static int open_private_file(const char *path, int flags)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | flags, 0600);
+	if (fd < 0) {
+		log_warn("Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fchmod(fd, 0600);
+	return fd;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+/**
+ * The header of a cached TLS session. It is followed by the salted
+ * hash of the session key, the session data and the session key.
+ */
+struct tls_record {
+	uint32_t key_len;	/**< The session key length, 0 for none */
+	uint32_t shmac_len;	/**< The salted hash length */
+	uint32_t sdata_len;	/**< The session data length */
+	int64_t valid_until;	/**< The expiry time, 0 for unknown */
+};
+
+/**
+ * Check whether libcurl was built with TLS session export.
+ * @return true if the sessions can be exported.
+ */
+static bool tls_export_supported(void)
+{
+	const char *const *name =
+		curl_version_info(CURLVERSION_NOW)->feature_names;
+
+	for (; name && *name; name++)
+		if (!strcmp(*name, "SSLS-EXPORT"))
+			return true;
+	return false;
+}
+
+static CURLcode export_tls_session(CURL *curl, void *userptr,
+				   const char *session_key,
+				   const unsigned char *shmac,
+				   size_t shmac_len,
+				   const unsigned char *sdata,
+				   size_t sdata_len,
+				   curl_off_t valid_until,
+				   int ietf_tls_id,
+				   const char *alpn,
+				   size_t earlydata_max)
+{
+	FILE *f = (FILE *)userptr;
+	struct tls_record rec = { 0, };
+	(void)curl;
+	(void)ietf_tls_id;
+	(void)alpn;
+	(void)earlydata_max;
+
+	rec.key_len = session_key ? strlen(session_key) : 0;
+	rec.shmac_len = shmac_len;
+	rec.sdata_len = sdata_len;
+	rec.valid_until = valid_until;
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+	    fwrite(shmac, 1, shmac_len, f) != shmac_len ||
+	    fwrite(sdata, 1, sdata_len, f) != sdata_len ||
+	    fwrite(session_key, 1, rec.key_len, f) != rec.key_len)
+		return CURLE_WRITE_ERROR;
+	return CURLE_OK;
+}
+
+/**
+ * Write the TLS sessions of the session handle to the cache.
+ * @param c - the cloud descriptor.
+ */
+static void save_tls_sessions(struct cld *c)
+{
+	FILE *f;
+	int fd;
+
+	if (!c->session->tls_file ||
+	    (fd = open_private_file(c->session->tls_file, O_TRUNC)) < 0)
+		return;
+	if (!(f = fdopen(fd, "wb"))) {
+		close(fd);
+		return;
+	}
+	if (curl_easy_ssls_export(c->curl, export_tls_session, f) != CURLE_OK)
+		log_debug("Could not export TLS sessions\n");
+	fclose(f);
+}
+
+/**
+ * Import the cached TLS sessions which have not expired yet.
+ * @param c - the cloud descriptor.
+ */
+static void load_tls_sessions(struct cld *c)
+{
+	FILE *f;
+	struct tls_record rec;
+	unsigned char *buf = NULL;
+	int64_t now = time(NULL);
+	size_t nr_sessions = 0;
+
+	if (!c->session->tls_file ||
+	    !(f = fopen(c->session->tls_file, "rb")))
+		return;
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		size_t len = (size_t)rec.shmac_len + rec.sdata_len + rec.key_len;
+		if (len > SESSION_MAX_TLS_RECORD)
+			break;
+		buf = xrealloc(buf, len + 1);
+		if (fread(buf, 1, len, f) != len)
+			break;
+		buf[len] = 0;
+		if (rec.valid_until && rec.valid_until <= now)
+			continue;
+		if (curl_easy_ssls_import(c->curl, rec.key_len
+					  ? (char *)buf + len - rec.key_len
+					  : NULL,
+					  buf, rec.shmac_len,
+					  buf + rec.shmac_len,
+					  rec.sdata_len) == CURLE_OK)
+			nr_sessions++;
+	}
+	free(buf);
+	fclose(f);
+	log_debug("%zu TLS sessions restored\n", nr_sessions);
+}
+#else
+/* TLS sessions cannot be exported with older libcurl versions */
+static bool tls_export_supported(void) { return false; }
+static void save_tls_sessions(struct cld *c) { (void)c; }
+static void load_tls_sessions(struct cld *c) { (void)c; }
+#endif
+
+/**
+ * Initialize the session with the credentials and locate its cache.
+ * @param s - the session;
+ * @param user - the user name;
+ * @param password - the password;
+ * @param domain - the user domain.
+ */
+void session_init(struct session *s, const char *user, const char *password,
+		  const char *domain)
+{
+	char *dir;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	if (user)
+		s->user = xstrdup(user);
+	if (password)
+		s->password = xstrdup(password);
+	if (domain)
+		s->domain = xstrdup(domain);
+
+	if (!user || !domain || !(dir = make_cache_dir()))
+		return;
+
+	s->cookie_file = make_cache_path(dir, user, domain,
+					 SESSION_COOKIE_SUFFIX);
+	s->token_file = make_cache_path(dir, user, domain,
+					SESSION_TOKEN_SUFFIX);
+	if (tls_export_supported())
+		s->tls_file = make_cache_path(dir, user, domain,
+					      SESSION_TLS_SUFFIX);
+	free(dir);
+
+	/* CURL keeps the mode of an existing cookie jar */
+	if ((fd = open_private_file(s->cookie_file, 0)) < 0) {
+		free(s->cookie_file);
+		free(s->token_file);
+		free(s->tls_file);
+		s->cookie_file = s->token_file = s->tls_file = NULL;
+		return;
+	}
+	close(fd);
+}
+
+void session_cleanup(struct session *s)
+{
+	if (s->password) {
+		memset(s->password, 0, strlen(s->password));
+		free(s->password);
+	}
+	free(s->user);
+	free(s->domain);
+	free(s->cookie_file);
+	free(s->token_file);
+	free(s->tls_file);
+	memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Read the cached token.
+ * @param s - the session.
+ * @return the allocated token, or NULL if there is none.
+ */
+static char *load_token(struct session *s)
+{
+	char buf[SESSION_MAX_TOKEN + 1];
+	ssize_t len;
+	int fd;
+
+	if (!s->token_file || (fd = open(s->token_file, O_RDONLY)) < 0)
+		return NULL;
+	len = read(fd, buf, SESSION_MAX_TOKEN);
+	close(fd);
+
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+		len--;
+	if (len <= 0)
+		return NULL;
+	return xstrndup(buf, len);
+}
+
+
+/**
+ * Enable cookies on the session handle and load the cached session.
+ * The session is not validated, this happens with the first request.
+ * @param c - the cloud descriptor.
+ * @return 0 if the cached session was loaded, or 1 if there is none.
+ */
+int session_restore(struct cld *c)
+{
+	struct session *s = c->session;
+
+	if (!s->cookie_file) {
+		/* Keep the cookies in memory */
+		curl_easy_setopt(c->curl, CURLOPT_COOKIEFILE, "");
+		return 1;
+	}
+	curl_easy_setopt(c->curl, CURLOPT_COOKIEFILE, s->cookie_file);
+	/* Load them now, as the option does not survive a handle reset */
+	curl_easy_setopt(c->curl, CURLOPT_COOKIELIST, "RELOAD");
+	load_tls_sessions(c);
+
+	if (!(c->auth_token = load_token(s)))
+		return 1;
+	log_debug("Using the cached session of %s\n", s->user);
+	return 0;
+}
+
+/**
+ * Write the cookies, the TLS sessions and the token of the session
+ * to the cache.
+ * @param c - the cloud descriptor.
+ */
+void session_save(struct cld *c)
+{
+	struct session *s = c->session;
+	int fd;
+
+	if (!s->cookie_file)
+		return;
+	curl_easy_setopt(c->curl, CURLOPT_COOKIEJAR, s->cookie_file);
+	curl_easy_setopt(c->curl, CURLOPT_COOKIELIST, "FLUSH");
+	save_tls_sessions(c);
+
+	if (!c->auth_token ||
+	    (fd = open_private_file(s->token_file, O_TRUNC)) < 0)
+		return;
+	if (write(fd, c->auth_token, strlen(c->auth_token)) < 0 ||
+	    write(fd, "\n", 1) < 0)
+		log_warn("Could not write %s: %s\n", s->token_file,
+			 strerror(errno));
+	close(fd);
+}
+
+static int login(struct cld *c)
+{
+	struct memory_struct chunk;
+	memory_struct_init(&chunk);
+
+	const char *names[] = { "Domain", "Login", "Password" };
+	const char *values[] = { c->session->domain, c->session->user,
+				 c->session->password };
+
+	int res = post_form_req(c->curl, &chunk, LOGIN_URL, names,
+				values, ARRAY_SIZE(names));
+
+	memory_struct_cleanup(&chunk);
+	return res;
+}
+
+static char *find_token(const char *data, size_t *len) {
+	static const char *tag = "\"token\":\"";
+	char *start = strstr(data, tag);
+	char *end;
+	if (!start)
+		return NULL;
+	start += strlen(tag);
+	end = strchr(start, '"');
+	if (!end)
+		return NULL;
+	*len = end - start;
+	return start;
+}
+
+static char *store_token(const char *data)
+{
+	char *buf = NULL;
+	size_t token_len;
+	char *token = find_token(data, &token_len);
+	if (!token || !token_len) {
+		log_error("Token not found\n");
+		return NULL;
+	}
+
+	if (!(buf = malloc(token_len + 1))) {
+		log_error("Token allocation failed\n");
+		return NULL;
+	}
+
+	memcpy(buf, token, token_len);
+	buf[token_len] = 0;
+
+	return buf;
+}
+
+/**
+ * Request a token over HTTP, allocate a memory
+ * buffer and store the token in the buffer.
+ * The request builder of the descriptor is not used, as the token
+ * may be requested while another request is being built.
+ * @return a pointer to the buffer for success, or NULL for error
+ */
+static char *get_token(struct cld *c)
+{
+	char *buf = NULL;
+	struct memory_struct chunk;
+
+	memory_struct_init(&chunk);
+
+	if (!get_req(c->curl, &chunk, TOKEN_URL))
+		buf = store_token(chunk.memory);
+
+	memory_struct_cleanup(&chunk);
+
+	return buf;
+}
+
+/**
+ * Replace the token of the session with a new one. The session cookies
+ * must still be valid. Called with the session lock held.
+ * @param c - the cloud descriptor.
+ * @return 0 for success, or 1 for error.
+ */
+int session_refresh_token(struct cld *c)
+{
+	char *token = get_token(c);
+
+	if (!token)
+		return 1;
+	log_debug("The token was refreshed\n");
+	free(c->auth_token);
+	c->auth_token = token;
+	session_save(c);
+	return 0;
+}
+
+/**
+ * Log in with the session credentials, get a new token
+ * and write the new session to the cache. Called with the session
+ * lock held once the descriptor is shared.
+ * @param c - the cloud descriptor.
+ * @return 0 for success, or 1 for error.
+ */
+int session_login(struct cld *c)
+{
+	char *token;
+
+	if (!c->session->user || !c->session->password ||
+	    !c->session->domain) {
+		log_error("No credentials to log in with\n");
+		return 1;
+	}
+
+	if (login(c))
+		return 1;
+
+	if (get_req(c->curl, NULL, SDC_URL))
+		return 1;
+
+	if (!(token = get_token(c)))
+		return 1;
+
+	free(c->auth_token);
+	c->auth_token = token;
+	session_save(c);
+	return 0;
+}
+
+/**
+ * Check whether the request failed because the server rejected
+ * the session.
+ * @param chunk - the response.
+ * @return true for an authentication error.
+ */
+static bool is_auth_error(const struct memory_struct *chunk)
+{
+	return chunk->code == 401 || chunk->code == 403;
+}
+
+/**
+ * Take a copy of the session token, as another thread may replace it.
+ * @param c - the cloud descriptor.
+ * @return the token copy, or NULL if there is no token.
+ */
+static char *copy_token(struct cld *c)
+{
+	char *token;
+
+	pthread_mutex_lock(&c->lock);
+	token = c->auth_token ? xstrdup(c->auth_token) : NULL;
+	pthread_mutex_unlock(&c->lock);
+	return token;
+}
+
+/**
+ * Renew the session rejected by the server: refresh the token on
+ * the first attempt, otherwise log in. Nothing is done if another
+ * thread has renewed the session since the token was taken.
+ * @param c - the cloud descriptor;
+ * @param token - the token the request was rejected with;
+ * @param attempt - the attempt number, set to 1 after a login.
+ * @return 0 for success, or 1 for error.
+ */
+static int session_renew(struct cld *c, const char *token, int *attempt)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->auth_token && token && strcmp(c->auth_token, token))
+		goto out;
+
+	if (*attempt == 0 && !session_refresh_token(c)) {
+		log_debug("The request was rejected, retrying "
+			  "with a new token\n");
+	} else {
+		log_warn("The session was rejected, "
+			 "logging in again\n");
+		res = session_login(c);
+		*attempt = 1;
+	}
+out:
+	pthread_mutex_unlock(&c->lock);
+	return res;
+}
+
+/**
+ * Perform the cloud API request built in the request builder of
+ * the calling thread, adding the token to it. If the server rejects
+ * the session, refresh the token and repeat the request. If it is
+ * rejected again, log in and repeat the request once more.
+ * @param c - the cloud descriptor;
+ * @param chunk - the memory structure receiving the response;
+ * @param post - whether to POST the form fields, otherwise GET the URL.
+ * @return 0 for success, or 1 for error.
+ */
+static int api_req(struct cld *c, struct memory_struct *chunk, bool post)
+{
+	struct request *req = cld_req(c);
+	size_t url_len = req->url.len;
+	size_t fields_len = req->fields.len;
+	const char *names[] = { "token" };
+	const char *values[] = { NULL };
+	char *token;
+	int attempt;
+	int res;
+	size_t reserved = http_req_buffers(chunk, false);
+
+	/* The JSON responses shrink several times when compressed */
+	chunk->compressed = true;
+	/* Running transfers may wait for the request, it must not wait */
+	mem_budget_charge(c->budget, reserved);
+	for (attempt = 0; ; attempt++) {
+		values[0] = token = copy_token(c);
+		if (post) {
+			res = request_add_fields(req, names, values, 1);
+			if (!res)
+				res = post_req(cld_curl(c), chunk, req);
+		} else {
+			res = request_add_params(req, names, values, 1);
+			if (!res)
+				res = hedged_get_req(c, chunk, req->url.buf);
+		}
+
+		if (!res || attempt > 1 || !is_auth_error(chunk) ||
+		    session_renew(c, token, &attempt)) {
+			free(token);
+			mem_budget_release(c->budget, reserved);
+			return res;
+		}
+		free(token);
+
+		strbuf_truncate(&req->url, url_len);
+		strbuf_truncate(&req->fields, fields_len);
+		chunk->size = 0;
+	}
+}
+
+/**
+ * GET the URL built in the request builder of the descriptor
+ * with the token added.
+ * @param c - the cloud descriptor;
+ * @param chunk - the memory structure receiving the response.
+ * @return 0 for success, or 1 for error.
+ */
+int api_get_req(struct cld *c, struct memory_struct *chunk)
+{
+	return api_req(c, chunk, false);
+}
+
+/**
+ * POST the form fields built in the request builder of the descriptor
+ * with the token added.
+ * @param c - the cloud descriptor;
+ * @param chunk - the memory structure receiving the response.
+ * @return 0 for success, or 1 for error.
+ */
+int api_post_req(struct cld *c, struct memory_struct *chunk)
+{
+	return api_req(c, chunk, true);
+}
@@ -35,6 +35,8 @@
 #include <claud/http_api.h>
 #include <claud/cld.h>
 #include <claud/jsmn_utils.h>
+#include <claud/session.h>
+#include <claud/thread.h>
 #include <claud/utils.h>
 
 #define SHARE_BUFFER_SIZE 1024
@@ -50,8 +52,7 @@ static char *parse_json_for_share_link(struct memory_struct *chunk)
 	jsmn_init(&p);
 	if (!(tok = parse_json(&p, chunk->memory, chunk->size, &tokcount))) {
 		log_error("Could not parse JSON\n");
-		chunk->memory[chunk->size - 1] = 0;
-		log_error("%s\n", chunk->memory);
+		log_error("%.*s\n", (int)chunk->size, chunk->memory);
 		return NULL;
 	}
 	
@@ -62,7 +63,7 @@ static char *parse_json_for_share_link(struct memory_struct *chunk)
 			sprintf(link, "%s%s", PUBLIC_ENDPOINT, s);
 		free(s);
 	}
-	free(tok);
+	json_tokens_release(tok);
 	return link;
 }
 
@@ -76,21 +77,24 @@ static char *parse_json_for_share_link(struct memory_struct *chunk)
 char *cld_file_share(struct cld *c, const char *path)
 {
 	char *link = NULL;
-	const char *names[] = { "token", "api", "home" };
-	const char *values[] = { c->auth_token, "2", path };
-	char *url = make_url("file/publish");
+	const char *names[] = { "api", "home" };
+	const char *values[] = { "2", path };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/publish");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return NULL;
 	
 	struct memory_struct chunk;
 	memory_struct_init(&chunk);
 	
-	if (post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names))) {
+	if (api_post_req(c, &chunk)) {
 		log_error("file publish failed, Msg: %.*s\n",
 			(int)chunk.size, chunk.memory);
 	} else {
 		link = parse_json_for_share_link(&chunk);
 	}
 
-	free(url);
 	memory_struct_cleanup(&chunk);
 	return link;
 }
@@ -0,0 +1,165 @@
+/**
+ * @file cld_thread.c
+ * Implementation of the per-thread state for Mail.Ru Cloud access
+ * library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <claud/http_api.h>
+#include <claud/cld.h>
+#include <claud/conn_pool.h>
+#include <claud/thread.h>
+#include <claud/utils.h>
+
+/**
+ * Initialize the per-thread state of the session.
+ * @param c - the cloud descriptor.
+ * @return 0 for success, or 1 for error.
+ */
+int cld_threads_init(struct cld *c)
+{
+	c->threads = NULL;
+	if (pthread_key_create(&c->thread_key, NULL)) {
+		log_error("pthread_key_create() failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+static void cld_thread_free(struct cld_thread *t)
+{
+	if (t->multi)
+		curl_multi_cleanup(t->multi);
+	curl_easy_cleanup(t->curl);
+	request_cleanup(&t->req);
+	free(t);
+}
+
+/**
+ * Free the state of all threads of the session.
+ * No thread may use the session any more.
+ * @param c - the cloud descriptor.
+ */
+void cld_threads_cleanup(struct cld *c)
+{
+	struct cld_thread *t, *next;
+
+	pthread_key_delete(c->thread_key);
+	for (t = c->threads; t; t = next) {
+		next = t->next;
+		cld_thread_free(t);
+	}
+	c->threads = NULL;
+}
+
+/**
+ * Get the state of the calling thread, creating it on the first call.
+ * The handle of the thread shares the cookies, the DNS cache and the TLS
+ * sessions of the pool, but keeps its own connections.
+ * @param c - the cloud descriptor.
+ * @return the thread state.
+ */
+static struct cld_thread *cld_thread_get(struct cld *c)
+{
+	struct cld_thread *t = pthread_getspecific(c->thread_key);
+
+	if (t)
+		return t;
+
+	t = xcalloc(1, sizeof(*t));
+	if (!(t->curl = curl_easy_init())) {
+		log_error("curl_easy_init() failed\n");
+		exit(1);
+	}
+	conn_pool_attach(c->pool, t->curl);
+	request_init(&t->req);
+	pthread_setspecific(c->thread_key, t);
+
+	pthread_mutex_lock(&c->lock);
+	t->next = c->threads;
+	c->threads = t;
+	pthread_mutex_unlock(&c->lock);
+	return t;
+}
+
+/**
+ * Get the CURL handle of the calling thread.
+ * @param c - the cloud descriptor.
+ * @return the handle.
+ */
+CURL *cld_curl(struct cld *c)
+{
+	return cld_thread_get(c)->curl;
+}
+
+/**
+ * Get the multi handle of the calling thread, creating it on the first
+ * call. The hedged requests of the thread run in it, so that their
+ * connections outlive a single request.
+ * @param c - the cloud descriptor.
+ * @return the handle, or NULL for error.
+ */
+CURLM *cld_multi(struct cld *c)
+{
+	struct cld_thread *t = cld_thread_get(c);
+
+	if (!t->multi && !(t->multi = curl_multi_init()))
+		log_error("curl_multi_init() failed\n");
+	return t->multi;
+}
+
+/**
+ * Get the request builder of the calling thread.
+ * @param c - the cloud descriptor.
+ * @return the request builder.
+ */
+struct request *cld_req(struct cld *c)
+{
+	return &cld_thread_get(c)->req;
+}
+
+/**
+ * Free the state of the calling thread. A thread which used
+ * the session should call it before exiting, otherwise the state
+ * is only freed by delete_cloud(). The state is created again if
+ * the thread makes another request.
+ * @param c - the cloud descriptor.
+ */
+void cld_thread_release(struct cld *c)
+{
+	struct cld_thread *t = pthread_getspecific(c->thread_key);
+	struct cld_thread **p;
+
+	if (!t)
+		return;
+	pthread_setspecific(c->thread_key, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	for (p = &c->threads; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	cld_thread_free(t);
+}
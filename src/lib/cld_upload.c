@@ -37,6 +37,9 @@
 #include <claud/http_api.h>
 #include <claud/cld.h>
 #include <claud/jsmn_utils.h>
+#include <claud/session.h>
+#include <claud/thread.h>
+#include <claud/transfer.h>
 #include <claud/utils.h>
 
 /**
@@ -54,15 +57,18 @@ static int add_file(struct cld *c,
 {
 	log_debug("dst '%s' hash '%s' size '%s'\n", dst, hash, size);
 	int res;
-	const char *names[] = { "token", "home", "conflict", "hash", "size" };
-	const char *values[] = { c->auth_token, dst, "strict", hash, size };
-	char *url = make_url("file/add");
+	const char *names[] = { "home", "conflict", "hash", "size" };
+	const char *values[] = { dst, "strict", hash, size };
+	struct request *req = cld_req(c);
+
+	request_url(req, URL_BASE, "file/add");
+	if (request_add_fields(req, names, values, ARRAY_SIZE(names)))
+		return 1;
 
 	struct memory_struct chunk;
 	
 	memory_struct_init(&chunk);
-	res = post_req(c->curl, &chunk, url, names, values, ARRAY_SIZE(names));
-	free(url);
+	res = api_post_req(c, &chunk);
 	if (res)
 		log_error("add_file failed, Msg: %.*s\n",
 			(int)chunk.size, chunk.memory);
@@ -73,43 +79,19 @@ static int add_file(struct cld *c,
 }
 
 /**
- * Upload a part of a local file to a remote file.
+ * Add an uploaded file part to the remote file storage.
+ * The upload response ends with the hash and the size of the part.
+ * Called by the transfer engine as soon as the part is uploaded.
  * @param c - the cloud descriptor;
- * @param dst - the remote file path;
- * @param f - the local file descriptor;
- * @param length - the size of the file part;
- * @param part - the number of the file part.
+ * @param job - the upload job of the part.
  * @return 0 for success, or error code.
  */
-static int upload_file_part(struct cld *c, const char *dst, FILE *f,
-			    size_t length, int part)
+static int add_uploaded_file(struct cld *c, struct xfer_job *job)
 {
-	int res = 0;
-	off_t offset = MAX_FILE_SIZE * part;
-	struct memory_struct chunk;
-	void *addr;
-	struct upload_stream upst = {0,};
-	
-	memory_struct_init(&chunk);
-	chunk.show_progress = true;
-	
-	addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(f), offset);
-	if (!addr) {
-		log_error("mmap failed\n");
-		res = 1;
-		goto out;
-	}
-	upst.addr = addr;
-	upst.left = length;
-	
-	res = upload_req(c->curl, &chunk, c->shard.upload, dst, &upst);
-	if (res) {
-		log_error("Could not upload file part\n");
-		goto out_unmap;
-	}
+	struct memory_struct *chunk = &job->chunk;
 
-	chunk.memory[chunk.size-1] = 0;
-	char *s = trimwhitespace(chunk.memory);
+	chunk->memory[chunk->size-1] = 0;
+	char *s = trimwhitespace(chunk->memory);
 	char *s0 = strrchr(s, '\n');
 	if (!s0) {
 		log_debug("s0 is NULL\n");
@@ -124,71 +106,157 @@ static int upload_file_part(struct cld *c, const char *dst, FILE *f,
 		s1 = "";
 	}
 	log_debug("s0: %s\ns1: %s\n", s0, s1);
-	res = add_file(c, dst, s0, s1);
-	
-out_unmap:
-	munmap(addr, length);
-out:
-	memory_struct_cleanup(&chunk);
-	return res;
+	return add_file(c, job->path, s0, s1);
 }
 
 /**
- * Upload a local file to a remote destination.
- * @param c - the cloud descriptor;
- * @param src - source, the local file path.
- * @param dst - destination, the remote file path.
+ * A local file sent by a batch upload.
+ */
+struct put_file {
+	int fd;			/**< The local file descriptor, or -1 */
+	size_t nr_parts;	/**< The number of remote parts */
+	char **names;		/**< The remote part paths */
+};
+
+/**
+ * Open a local file and add the upload jobs of its parts.
+ * @param pf - the local file descriptor to fill in;
+ * @param src - the local path;
+ * @param dst - the remote path;
+ * @param flow - the flow of the file;
+ * @param jobs - the job array, grown as needed;
+ * @param nr_jobs - the number of jobs, updated.
  * @return 0 for success, or error code.
  */
-int cld_upload(struct cld *c, const char *src, const char *dst)
+static int put_file_prepare(struct put_file *pf, const char *src,
+			    const char *dst, int flow,
+			    struct xfer_job **jobs, size_t *nr_jobs)
 {
-	int res = 0;
-	FILE *f;
 	struct stat sb;
+	size_t i;
 	
 	static const char *mp_str = PART_SUFFIX;
-	char *mpbuf = malloc(strlen(src) + strlen(mp_str) + 10);
-	if (!mpbuf) {
-		log_error("Out of memory\n");
-		return 1;
-	}
 
-	if (cld_get_shard_info(c))
-		return 1;
-	
-	if (!(f = fopen(src, "r"))) {
+	if ((pf->fd = open(src, O_RDONLY)) < 0) {
 		log_error("Could not open file\n");
-		goto out;
+		return 1;
 	}
-	if (fstat(fileno(f), &sb) == -1) {
+	if (fstat(pf->fd, &sb) == -1) {
 		log_error("fstat\n");
-		res = 1;
-		goto out_close;
+		return 1;
 	}
 
-	if (sb.st_size <= MAX_FILE_SIZE) {
-		res = upload_file_part(c, dst, f, sb.st_size, 0);
-	} else {
-		off_t spos = 0;
-		int part = 0;
-		for (; spos < sb.st_size && !res; spos += MAX_FILE_SIZE, part++) {
-			size_t n = spos + MAX_FILE_SIZE <= sb.st_size
-				? MAX_FILE_SIZE
-				: sb.st_size % MAX_FILE_SIZE;
-			sprintf(mpbuf, "%s%s%02d", dst, mp_str, part);
-			res = upload_file_part(c, mpbuf, f, n, part);
+	pf->nr_parts = sb.st_size <= MAX_FILE_SIZE
+		? 1
+		: (sb.st_size + MAX_FILE_SIZE - 1) / MAX_FILE_SIZE;
+	pf->names = xcalloc(pf->nr_parts, sizeof(*pf->names));
+	*jobs = xrealloc(*jobs, (*nr_jobs + pf->nr_parts) * sizeof(**jobs));
+
+	for (i = 0; i < pf->nr_parts; i++) {
+		struct xfer_job *job = &(*jobs)[*nr_jobs];
+		off_t offset = MAX_FILE_SIZE * i;
+		size_t n = offset + MAX_FILE_SIZE <= (size_t)sb.st_size
+			? MAX_FILE_SIZE
+			: sb.st_size - offset;
+
+		if (pf->nr_parts == 1) {
+			pf->names[i] = xstrdup(dst);
+		} else {
+			pf->names[i] = xmalloc(strlen(dst) + strlen(mp_str) + 10);
+			sprintf(pf->names[i], "%s%s%02zu", dst, mp_str, i);
+		}
+		xfer_job_init(job, XFER_PUT, pf->names[i]);
+		job->flow = flow;
+		job->length = n;
+		job->chunk.show_progress = true;
+		job->on_done = add_uploaded_file;
+		(*nr_jobs)++;
+		/* An empty file has nothing to map, its job sends no data */
+		if (!n)
+			continue;
+		job->addr = mmap(NULL, n, PROT_READ, MAP_PRIVATE, pf->fd,
+				 offset);
+		if (job->addr == MAP_FAILED) {
+			log_error("mmap failed\n");
+			job->addr = NULL;
+			return 1;
 		}
 	}
+	return 0;
+}
 
-out_close:
-	if (fclose(f)) {
+/**
+ * Close a local file of a batch upload.
+ * @param pf - the local file descriptor.
+ */
+static void put_file_cleanup(struct put_file *pf)
+{
+	size_t i;
+
+	for (i = 0; i < pf->nr_parts; i++)
+		free(pf->names[i]);
+	free(pf->names);
+	if (pf->fd >= 0 && close(pf->fd)) {
 		log_error("Failed to close file\n");
 	}
-out:
-	free(mpbuf);
+}
+
+/**
+ * Upload local files to remote destinations in one batch.
+ * The files and the parts of large files are uploaded in parallel,
+ * the smaller files first. Each part is added to the cloud as soon
+ * as it is uploaded.
+ * @param c - the cloud descriptor;
+ * @param src - the local file paths;
+ * @param dst - the remote file paths;
+ * @param nr_files - the number of files.
+ * @return 0 for success, or error code.
+ */
+int cld_upload_files(struct cld *c, const char *const src[],
+		     const char *const dst[], size_t nr_files)
+{
+	int res = 0;
+	struct put_file *files;
+	struct xfer_job *jobs = NULL;
+	size_t nr_jobs = 0, i;
+
+	if (cld_get_shard_info(c))
+		return 1;
+
+	files = xcalloc(nr_files, sizeof(*files));
+	for (i = 0; i < nr_files; i++)
+		files[i].fd = -1;
+	for (i = 0; !res && i < nr_files; i++)
+		res = put_file_prepare(&files[i], src[i], dst[i], i,
+				       &jobs, &nr_jobs);
+
+	if (!res && (res = xfer_run(c, jobs, nr_jobs)))
+		log_error("Could not upload file part\n");
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].addr)
+			munmap(jobs[i].addr, jobs[i].length);
+		xfer_job_cleanup(&jobs[i]);
+	}
+	free(jobs);
+	for (i = 0; i < nr_files; i++)
+		put_file_cleanup(&files[i]);
+	free(files);
 	return res;
 }
 
+/**
+ * Upload a local file to a remote destination.
+ * @param c - the cloud descriptor;
+ * @param src - source, the local file path.
+ * @param dst - destination, the remote file path.
+ * @return 0 for success, or error code.
+ */
+int cld_upload(struct cld *c, const char *src, const char *dst)
+{
+	return cld_upload_files(c, &src, &dst, 1);
+}
+
 /**
  * Create an empty file
  * @param c - the cloud descriptor;
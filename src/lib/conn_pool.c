@@ -0,0 +1,167 @@
+/**
+ * @file conn_pool.c
+ * Implementation of the connection pool for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <curl/curl.h>
+#include <claud/conn_pool.h>
+#include <claud/utils.h>
+
+static void share_lock(CURL *handle, curl_lock_data data,
+		       curl_lock_access access, void *userptr)
+{
+	struct conn_pool *pool = (struct conn_pool *)userptr;
+	(void)handle;
+	(void)access;
+	pthread_mutex_lock(&pool->locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	struct conn_pool *pool = (struct conn_pool *)userptr;
+	(void)handle;
+	pthread_mutex_unlock(&pool->locks[data]);
+}
+
+/**
+ * Initialize the connection pool. No handles are created until
+ * they are requested.
+ * @param pool - the pool.
+ * @return 0 for success, or 1 for error.
+ */
+int conn_pool_init(struct conn_pool *pool)
+{
+	size_t i;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&pool->locks[i], NULL);
+
+	if (!(pool->share = curl_share_init())) {
+		log_error("curl_share_init() failed\n");
+		return 1;
+	}
+	curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+	/*
+	 * The connection cache must not be shared by threads running
+	 * requests at once, a handle keeps its own connections, and
+	 * the handles run by a multi handle use the cache of the multi.
+	 */
+	return 0;
+}
+
+/**
+ * Release all handles of the pool and the shared data.
+ * Handles attached with conn_pool_attach() must be cleaned up before.
+ * @param pool - the pool.
+ */
+void conn_pool_cleanup(struct conn_pool *pool)
+{
+	size_t i;
+	for (i = 0; i < CONN_POOL_SIZE; i++)
+		if (pool->handles[i])
+			curl_easy_cleanup(pool->handles[i]);
+	if (pool->share)
+		curl_share_cleanup(pool->share);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy(&pool->locks[i]);
+	pthread_mutex_destroy(&pool->lock);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Make a handle created outside of the pool share the pool data,
+ * so that cookies, DNS entries and TLS sessions are visible to pooled
+ * handles.
+ * @param pool - the pool;
+ * @param curl - the handle.
+ */
+void conn_pool_attach(struct conn_pool *pool, CURL *curl)
+{
+	curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+}
+
+/**
+ * Take an idle handle from the pool, creating it if needed.
+ * Bulk transfers get at most CONN_POOL_MAX_BULK handles.
+ * @param pool - the pool;
+ * @param cls - the class of requests the handle is used for.
+ * @return the handle, or NULL if the pool is exhausted.
+ */
+CURL *conn_pool_acquire(struct conn_pool *pool, enum conn_class cls)
+{
+	CURL *curl = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	if (cls == CONN_BULK && pool->nr_bulk >= CONN_POOL_MAX_BULK)
+		goto out;
+	for (i = 0; i < CONN_POOL_SIZE; i++) {
+		if (pool->busy[i])
+			continue;
+		if (!pool->handles[i]) {
+			if (!(pool->handles[i] = curl_easy_init())) {
+				log_error("curl_easy_init() failed\n");
+				goto out;
+			}
+			conn_pool_attach(pool, pool->handles[i]);
+		}
+		pool->busy[i] = true;
+		pool->bulk[i] = cls == CONN_BULK;
+		if (pool->bulk[i])
+			pool->nr_bulk++;
+		curl = pool->handles[i];
+		break;
+	}
+out:
+	pthread_mutex_unlock(&pool->lock);
+	return curl;
+}
+
+/**
+ * Return a handle to the pool.
+ * @param pool - the pool;
+ * @param curl - the handle taken with conn_pool_acquire().
+ */
+void conn_pool_release(struct conn_pool *pool, CURL *curl)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < CONN_POOL_SIZE; i++) {
+		if (pool->handles[i] == curl) {
+			pool->busy[i] = false;
+			if (pool->bulk[i])
+				pool->nr_bulk--;
+			pool->bulk[i] = false;
+			pthread_mutex_unlock(&pool->lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	log_error("Releasing a handle not owned by the pool\n");
+}
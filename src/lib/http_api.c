@@ -20,18 +20,32 @@
  */
 
 #include <libgen.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <malloc.h>
 #include <string.h>
 #include <curl/curl.h>
 #include <claud/types.h>
 #include <claud/utils.h>
 #include <claud/http_api.h>
+#include <claud/bwlimit.h>
 
 void memory_struct_init(struct memory_struct *mem) {
 	mem->memory = malloc(1);
 	mem->buf_size = 0;
+	mem->sock_buf_size = 0;
 	mem->size = 0;
+	mem->code = 0;
+	mem->stall_speed = 0;
+	mem->stall_time = 0;
 	mem->show_progress = false;
+	mem->resume = false;
+	mem->compressed = false;
+	mem->bw = NULL;
+	mem->bw_pause = false;
+	mem->bw_resume = 0;
+	mem->sink = NULL;
 }
 
 void memory_struct_cleanup(struct memory_struct *mem) {
@@ -43,34 +57,6 @@ void memory_struct_reset(struct memory_struct *mem) {
 	memory_struct_init(mem);
 }
 
-static void print_cookies(CURL *curl)
-{
-	CURLcode res;
-	struct curl_slist *cookies;
-	struct curl_slist *nc;
-	int i;
-
-	log_debug("Cookies, curl knows:\n");
-	res = curl_easy_getinfo(curl, CURLINFO_COOKIELIST, &cookies);
-	if (res != CURLE_OK)
-	{
-		log_error("Curl curl_easy_getinfo failed: %s\n",
-			curl_easy_strerror(res));
-		return;
-	}
-	nc= cookies, i = 1;
-	while (nc)
-	{
-		log_debug("[%d]: %s\n", i, nc->data);
-		nc = nc->next;
-		i++;
-	}
-	if (i == 1)
-		log_debug("(none)\n");
-
-	curl_slist_free_all(cookies);
-}
-
 static int progress_callback(void *clientp, curl_off_t dltotal,
 	curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
 {
@@ -129,6 +115,15 @@ write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp)
 	size_t realsize = size * nmemb;
 	struct memory_struct *mem = (struct memory_struct *)userp;
 
+	if (!mem->bw_pause)
+		bw_limit_take(mem->bw, BW_DOWN, realsize);
+	else if ((mem->bw_resume = bw_limit_pause(mem->bw, BW_DOWN, realsize)))
+		return CURL_WRITEFUNC_PAUSE;
+
+	if (mem->sink)
+		return mem->sink->write(mem->sink->arg, contents, realsize)
+			? 0 : realsize;
+
 	char *ptr = realloc(mem->memory, mem->size + realsize + 1);
 	if(ptr == NULL) {
 		/* out of memory! */ 
@@ -144,96 +139,153 @@ write_memory_callback(void *contents, size_t size, size_t nmemb, void *userp)
 	return realsize;
 }
 
-char *make_url(const char *route)
+/**
+ * Set the socket buffer sizes of a new connection.
+ * @param clientp - the memory structure of the request;
+ * @param fd - the socket;
+ * @param purpose - the socket purpose.
+ * @return CURL_SOCKOPT_OK.
+ */
+static int sockopt_callback(void *clientp, curl_socket_t fd,
+			    curlsocktype purpose)
+{
+	struct memory_struct *mem = (struct memory_struct *)clientp;
+	int size = (int)mem->sock_buf_size;
+
+	if (purpose != CURLSOCKTYPE_IPCXN)
+		return CURL_SOCKOPT_OK;
+#ifdef SO_RCVBUF
+	/* Setting the sizes disables the kernel autotuning on Linux */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+		log_debug("Could not set socket buffers to %d\n", size);
+#endif
+	return CURL_SOCKOPT_OK;
+}
+
+/**
+ * Check whether a character may appear in a URL without being encoded.
+ * @param ch - the character.
+ * @return true for RFC 3986 unreserved characters.
+ */
+static inline bool is_unreserved(unsigned char ch)
 {
-	char *buf = malloc(strlen(URL_BASE) + strlen(route) + 1);
-	if (!buf)
-		log_error("Allocation failed\n");
-	else
-		sprintf(buf, "%s%s", URL_BASE, route);
-	return buf;
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+		(ch >= '0' && ch <= '9') ||
+		ch == '-' || ch == '.' || ch == '_' || ch == '~';
 }
 
 /**
- * Allocate a string and fill it with an URL-encoded parameter list.
- * @param curl - CURL handle used for encoding;
+ * URL-encode a string and append it to the buffer.
+ * @param sb - the buffer;
+ * @param s - the string to encode.
+ */
+static void strbuf_append_escaped(struct strbuf *sb, const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t n = strlen(s);
+	char *p;
+
+	/* Worst case: every character is percent-encoded */
+	strbuf_reserve(sb, n * 3);
+	p = sb->buf + sb->len;
+	for (; *s; s++) {
+		unsigned char ch = (unsigned char)*s;
+		if (is_unreserved(ch)) {
+			*p++ = ch;
+		} else {
+			*p++ = '%';
+			*p++ = hex[ch >> 4];
+			*p++ = hex[ch & 0xf];
+		}
+	}
+	*p = '\0';
+	sb->len = p - sb->buf;
+}
+
+/**
+ * Append URL-encoded name=value pairs to the buffer.
+ * @param sb - the buffer;
+ * @param sep - the separator put before the first pair, or 0 for none;
  * @param names - array of parameter names;
  * @param values - array of parameter values;
  * @param nr_params - the number of parameters.
- * @return pointer to the allocated string for success, or NULL for error.
+ * @return 0 for success, or 1 for an empty parameter.
  */
-char *make_params(CURL *curl, const char *names[], const char *values[],
-		  size_t nr_params)
+static int append_params(struct strbuf *sb, char sep, const char *names[],
+			 const char *values[], size_t nr_params)
 {
-	char *buf = NULL;
-	size_t buf_len = 0;
-	int i;
-	/* URL-escaped values */
-	char **esc_values = calloc(nr_params * 2, sizeof(char *));
-	if (!esc_values)
-		return NULL;
+	size_t i;
 	for (i = 0; i < nr_params; i++) {
 		if (!names[i] || !values[i]) {
 			log_error("Empty HTTP request parameter\n");
-			goto free_esc_values;
+			return 1;
 		}
-	
-		esc_values[i * 2] = curl_easy_escape(curl, names[i], 0);
-		if (!esc_values[i * 2])
-			goto free_esc_values;
-		esc_values[i * 2 + 1] = curl_easy_escape(curl, values[i], 0);
-		if (!esc_values[i * 2 + 1])
-			goto free_esc_values;
-		buf_len += strlen(esc_values[i * 2]) + 
-			   strlen(esc_values[i * 2 + 1]) + 2;
- 	}
- 	/* For empty parameter list, we return an empty string */
- 	if (buf_len == 0)
-		buf_len = 1;
-
-	if (!(buf = malloc(buf_len))) {
-		log_error("Allocation failed\n");
-		goto free_esc_values;
+		if (sep)
+			strbuf_append(sb, &sep, 1);
+		strbuf_append_escaped(sb, names[i]);
+		strbuf_append(sb, "=", 1);
+		strbuf_append_escaped(sb, values[i]);
+		sep = '&';
 	}
+	return 0;
+}
 
-	buf[0] = '\0';
-	for (i = 0; i < nr_params; i++) {
-		sprintf(buf + strlen(buf), "%s%s=%s", (i == 0 ? "" : "&"),
-			esc_values[i * 2], esc_values[i * 2 + 1]);
-	}
-	
-free_esc_values:	
-	for (i = 0; i < nr_params * 2; i++) {
-		curl_free(esc_values[i]);
-	}
-	free(esc_values);
-	return buf;
+void request_init(struct request *req)
+{
+	strbuf_init(&req->url);
+	strbuf_init(&req->fields);
 }
 
-char *make_url_with_params(struct CURL *curl,
-			   const char *route,
-			   const char *names[],
-			   const char *values[],
-			   size_t nr_params)
+void request_cleanup(struct request *req)
 {
-	char *buf = NULL;
-	char *param_str;
-	size_t buf_len;
+	strbuf_cleanup(&req->url);
+	strbuf_cleanup(&req->fields);
+}
 
-	if (nr_params == 0)
-		return make_url(route);
-	
-	if (!(param_str = make_params(curl, names, values, nr_params)))
-		return NULL;
+/**
+ * Start building a new request. The buffers of the previous request
+ * are reused.
+ * @param req - the request builder;
+ * @param base - the URL base;
+ * @param route - the route appended to the URL base as is.
+ */
+void request_url(struct request *req, const char *base, const char *route)
+{
+	strbuf_reset(&req->url);
+	strbuf_reset(&req->fields);
+	strbuf_append(&req->url, base, strlen(base));
+	strbuf_append(&req->url, route, strlen(route));
+}
 
-	buf_len = strlen(URL_BASE) + strlen(route) + strlen(param_str) + 2;
-	if (!(buf = malloc(buf_len)))
-		log_error("Allocation failed\n");
-	else
-		sprintf(buf, "%s%s?%s", URL_BASE, route, param_str);
-	
-	free(param_str);
-	return buf;
+/**
+ * Append URL-encoded query parameters to the request URL.
+ * @param req - the request builder;
+ * @param names - array of parameter names;
+ * @param values - array of parameter values;
+ * @param nr_params - the number of parameters.
+ * @return 0 for success, or 1 for error.
+ */
+int request_add_params(struct request *req, const char *names[],
+		       const char *values[], size_t nr_params)
+{
+	char sep = strchr(req->url.buf, '?') ? '&' : '?';
+	return append_params(&req->url, sep, names, values, nr_params);
+}
+
+/**
+ * Append URL-encoded form fields to the request body.
+ * @param req - the request builder;
+ * @param names - array of field names;
+ * @param values - array of field values;
+ * @param nr_params - the number of fields.
+ * @return 0 for success, or 1 for error.
+ */
+int request_add_fields(struct request *req, const char *names[],
+		       const char *values[], size_t nr_params)
+{
+	char sep = req->fields.len ? '&' : 0;
+	return append_params(&req->fields, sep, names, values, nr_params);
 }
 
 static void fill_post_form(curl_mime *mime,
@@ -251,34 +303,87 @@ static void fill_post_form(curl_mime *mime,
 	}
 }
 
-int http_req(CURL *curl, struct memory_struct *chunk, const char *url)
+/**
+ * Get the memory the buffers of a request take while it runs:
+ * the libcurl receive buffer, the upload buffer of uploads and
+ * the socket buffers set for new connections.
+ * @param chunk - the memory structure of the request;
+ * @param upload - whether the request uploads a file.
+ * @return the size in bytes.
+ */
+size_t http_req_buffers(const struct memory_struct *chunk, bool upload)
 {
-	CURLcode res;
-	int resp_code;
-	struct curl_slist *cookies = NULL;
-	struct progress_data progress_data = { 0, };
+	size_t size = chunk->buf_size ? chunk->buf_size : CURL_MAX_WRITE_SIZE;
+
+	if (upload)
+		size += chunk->buf_size ? chunk->buf_size : UPLOAD_BUFFERSIZE;
+	/* Both the receive and the send buffer are set */
+	return size + 2 * chunk->sock_buf_size;
+}
 
+/**
+ * Set up the options common for all requests.
+ * @param curl - the CURL handle;
+ * @param chunk - the response memory, or NULL to skip the body;
+ * @param url - the request URL;
+ * @param progress_data - the progress state, or NULL to disable progress.
+ */
+void http_req_setup(CURL *curl, struct memory_struct *chunk, const char *url,
+		    struct progress_data *progress_data)
+{
 	log_debug("URL: %s\n", url); 
 
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, USER_AGENT);
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	/* Handles may be used from several threads */
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
 
 	if (chunk) {
-		if (chunk->show_progress) {
+		if (chunk->show_progress && progress_data) {
 			curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 			curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION,
 					 progress_callback);
 			curl_easy_setopt(curl, CURLOPT_XFERINFODATA,
-					 &progress_data);
-			progress_data.session = curl;
+					 progress_data);
+			progress_data->session = curl;
 		} else {
 			curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 		}
 
+		/* Abort the transfer if it stalls */
+		if (chunk->stall_speed > 0) {
+			curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
+					 chunk->stall_speed);
+			curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+					 chunk->stall_time);
+		}
+		/* Request the rest of a partially received response */
+		if (chunk->resume && chunk->size)
+			curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE,
+					 (curl_off_t)chunk->size);
+		/*
+		 * Let the server compress the response, libcurl inflates
+		 * it piece by piece before it reaches the write callback.
+		 * Resumed downloads count decoded bytes, so they are not
+		 * compressed.
+		 */
+		if (chunk->compressed && !chunk->resume)
+			curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
 		/* Set buffer size to receive data */
 		if (chunk->buf_size)
-			curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, chunk->buf_size);
+			curl_easy_setopt(curl, CURLOPT_BUFFERSIZE,
+					 (long)bw_limit_chunk(chunk->bw, BW_DOWN,
+							      chunk->buf_size));
+		if (chunk->sock_buf_size) {
+			curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION,
+					 sockopt_callback);
+			curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, chunk);
+		}
+		if (chunk->sink)
+			chunk->sink->start(chunk->sink->arg);
 		/* send all data to this function  */ 
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_callback);
 		/* we pass our 'chunk' struct to the callback function */ 
@@ -286,17 +391,26 @@ int http_req(CURL *curl, struct memory_struct *chunk, const char *url)
 	} else {
 		curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
 	}
+}
 
-	res = curl_easy_perform(curl);
+/**
+ * Check the outcome of a finished request.
+ * @param curl - the CURL handle;
+ * @param chunk - the response memory receiving the response code, or NULL;
+ * @param res - the transfer result.
+ * @return 0 for success, or 1 for error.
+ */
+int http_req_result(CURL *curl, struct memory_struct *chunk, CURLcode res)
+{
+	long resp_code = 0;
 
-	/* Parse result */
-	res = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp_code);
 	if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp_code) !=
 			CURLE_OK) {
-		log_error("curl_easy_getinfo failed: %s\n",
-					curl_easy_strerror(res));
+		log_error("curl_easy_getinfo failed\n");
 		resp_code = 0;
 	}
+	if (chunk)
+		chunk->code = resp_code;
 	
 	/* Check for errors */ 
 	if (res != CURLE_OK) {
@@ -304,34 +418,32 @@ int http_req(CURL *curl, struct memory_struct *chunk, const char *url)
 		return 1;
 	}
 
-	if (resp_code != 200 && resp_code != 302) {
-		log_error("HTTP response code: %d\n", resp_code);
+	/* 206 answers a resumed download */
+	if (resp_code != 200 && resp_code != 206 && resp_code != 302) {
+		log_error("HTTP response code: %ld\n", resp_code);
 		return 1;
 	}
 
 	return 0;
 }
 
+int http_req(CURL *curl, struct memory_struct *chunk, const char *url)
+{
+	struct progress_data progress_data = { 0, };
+
+	http_req_setup(curl, chunk, url, &progress_data);
+	return http_req_result(curl, chunk, curl_easy_perform(curl));
+}
+
 int post_req(CURL *curl,
 	     struct memory_struct *chunk,
-	     const char *url,
-	     const char *names[],
-	     const char *values[],
-	     size_t nr_params)
+	     const struct request *req)
 {
-	int res;
-	char *param_str;
-	
-	if (!(param_str= make_params(curl, names, values, nr_params)))
-		return 1;
-	
 	curl_easy_reset(curl);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, param_str);	
-	
-	res = http_req(curl, chunk, url);
-	free(param_str);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->fields.buf);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)req->fields.len);
 
-	return res;
+	return http_req(curl, chunk, req->url.buf);
 }
 
 int post_form_req(CURL *curl,
@@ -366,17 +478,130 @@ int get_req(CURL *curl, struct memory_struct *chunk, const char *url)
 	return http_req(curl, chunk, url);
 }
 
+/**
+ * Perform an idempotent GET request, sending a duplicate of it over
+ * the backup handle if no response arrives within the specified delay.
+ * The first successful response wins and the other request is cancelled.
+ * Both requests run in the given multi handle, whose connection cache
+ * keeps their connections open for the next hedged request.
+ * @param multi - the multi handle running the requests;
+ * @param curl - the primary CURL handle;
+ * @param backup - the backup CURL handle, or NULL to never hedge;
+ * @param chunk - the memory structure receiving the response;
+ * @param url - the request URL;
+ * @param delay_ms - the delay before the duplicate request is sent;
+ * @param hedged - set to true if the duplicate request was sent.
+ * @return 0 for success, or 1 for error.
+ */
+int get_req_hedged(CURLM *multi, CURL *curl, CURL *backup,
+		   struct memory_struct *chunk, const char *url,
+		   long delay_ms, bool *hedged)
+{
+	int res = 1;
+	int running = 0;
+	int nr_active = 1;
+	CURL *winner = NULL;
+	struct memory_struct backup_chunk;
+	int64_t start = get_time_ms();
+
+	*hedged = false;
+	curl_easy_reset(curl);
+	http_req_setup(curl, chunk, url, NULL);
+	curl_multi_add_handle(multi, curl);
+
+	memory_struct_init(&backup_chunk);
+	backup_chunk.buf_size = chunk->buf_size;
+	backup_chunk.compressed = chunk->compressed;
+
+	while (nr_active > 0 && !winner) {
+		CURLMsg *msg;
+		int nr_msgs;
+		int timeout_ms = 1000;
+
+		if (curl_multi_perform(multi, &running) != CURLM_OK) {
+			log_error("curl_multi_perform failed\n");
+			break;
+		}
+
+		while ((msg = curl_multi_info_read(multi, &nr_msgs))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			nr_active--;
+			if (!winner && !http_req_result(msg->easy_handle,
+					msg->easy_handle == curl
+					? chunk : &backup_chunk,
+					msg->data.result))
+				winner = msg->easy_handle;
+		}
+		if (winner || nr_active == 0)
+			break;
+
+		if (backup && !*hedged) {
+			int64_t elapsed = get_time_ms() - start;
+			if (elapsed >= delay_ms) {
+				log_debug("Hedging request after %ld ms\n",
+					  (long)elapsed);
+				curl_easy_reset(backup);
+				http_req_setup(backup, &backup_chunk, url, NULL);
+				curl_multi_add_handle(multi, backup);
+				*hedged = true;
+				nr_active++;
+				continue;
+			}
+			timeout_ms = (int)(delay_ms - elapsed);
+		}
+
+		curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+	}
+
+	/* Removing a running handle cancels its transfer */
+	curl_multi_remove_handle(multi, curl);
+	if (*hedged)
+		curl_multi_remove_handle(multi, backup);
+
+	if (winner) {
+		res = 0;
+		if (winner == backup) {
+			struct memory_struct tmp = *chunk;
+			*chunk = backup_chunk;
+			backup_chunk = tmp;
+		}
+	}
+	memory_struct_cleanup(&backup_chunk);
+
+	return res;
+}
+
 static size_t read_callback_mm(void *ptr, size_t size, size_t nmemb, void *stream)
 {
 	struct upload_stream *upst = (struct upload_stream *)stream;
-	size_t copy_size = nmemb * size;
+	size_t copy_size = bw_limit_chunk(upst->bw, BW_UP, nmemb * size);
 	if (copy_size > upst->left)
 		copy_size = upst->left;
+	/* Also covers an empty file, which has no mapping */
+	if (!copy_size)
+		return 0;
 
+	if (!upst->bw_pause)
+		bw_limit_take(upst->bw, BW_UP, copy_size);
+	else if ((upst->bw_resume = bw_limit_pause(upst->bw, BW_UP, copy_size)))
+		return CURL_READFUNC_PAUSE;
 	memcpy(ptr, upst->addr, copy_size);
 	upst->left -= copy_size;
 	upst->addr += copy_size;
 
+	/* Do not let the sent pages of a large mapping pile up in memory */
+	if (upst->base) {
+		size_t sent = upst->addr - upst->base;
+		size_t len = (sent - upst->dropped) &
+			~((size_t)sysconf(_SC_PAGE_SIZE) - 1);
+
+		if (len >= UPLOAD_DROP_STEP) {
+			madvise(upst->base + upst->dropped, len, MADV_DONTNEED);
+			upst->dropped += len;
+		}
+	}
+
 	return copy_size / size;
 }
 
@@ -413,40 +638,56 @@ read_callback(void *ptr, size_t size, size_t nmemb, void *stream)
 }
 
 // TODO: Move to https://curl.haxx.se/libcurl/c/curl_mime_data_cb.html
-int upload_req(CURL *curl,
-	       struct memory_struct *chunk,
-	       const char *url,
-	       const char *dst,
-	       struct upload_stream *upst)
+/**
+ * Set up a file upload request without performing it.
+ * @param curl - the CURL handle;
+ * @param chunk - the memory structure receiving the response;
+ * @param url - the upload URL;
+ * @param dst - the remote file path;
+ * @param upst - the upload stream;
+ * @param form - the form to release with upload_form_cleanup()
+ * after the request;
+ * @param progress_data - the progress state, or NULL to disable progress.
+ * @return 0 for success, or 1 for error.
+ */
+int upload_req_setup(CURL *curl,
+		     struct memory_struct *chunk,
+		     const char *url,
+		     const char *dst,
+		     struct upload_stream *upst,
+		     struct upload_form *form,
+		     struct progress_data *progress_data)
 {
-	int res;
-	struct curl_slist *cookies = NULL;
-	struct curl_slist *header_list = NULL;
-	struct curl_httppost *formpost = NULL;
 	struct curl_httppost *lastptr = NULL;
 
-	char *filename = copy_basename(dst);
-	if (!filename) {
+	memset(form, 0, sizeof(*form));
+	form->filename = copy_basename(dst);
+	if (!form->filename) {
 		log_error("Failed to allocate filename\n");
 		return 1;
 	}
 	
 	curl_easy_reset(curl);
+	upst->bw = chunk->bw;
+	upst->bw_pause = chunk->bw_pause;
+	upst->bw_resume = 0;
 	
-	curl_formadd(&formpost,
+	curl_formadd(&form->formpost,
 		&lastptr,
 		CURLFORM_COPYNAME, "file",
-		CURLFORM_FILENAME, filename,
+		CURLFORM_FILENAME, form->filename,
 		CURLFORM_STREAM, upst,
 		CURLFORM_CONTENTLEN, upst->left,
 		CURLFORM_END);
 	
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-	curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
+	curl_easy_setopt(curl, CURLOPT_HTTPPOST, form->formpost);
 
 #ifdef CURLOPT_UPLOAD_BUFFERSIZE
 	/* Supported since libcurl v.7.62 */
-	curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, UPLOAD_BUFFERSIZE);
+	curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE,
+			 chunk->buf_size ? (long)chunk->buf_size
+			 : UPLOAD_BUFFERSIZE);
 #endif
 	
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback_mm);
@@ -454,16 +695,40 @@ int upload_req(CURL *curl,
 
 	/* Include server headers in the output */
 	curl_easy_setopt(curl, CURLOPT_HEADER, 1L);
-	header_list = curl_slist_append(header_list, "Expect:");
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+	form->headers = curl_slist_append(form->headers, "Expect:");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, form->headers);
 	
 	
 	curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 
-	res = http_req(curl, chunk, url);
-	curl_slist_free_all(header_list);
-	curl_formfree(formpost);
-	free(filename);
+	http_req_setup(curl, chunk, url, progress_data);
+	return 0;
+}
+
+void upload_form_cleanup(struct upload_form *form)
+{
+	curl_slist_free_all(form->headers);
+	curl_formfree(form->formpost);
+	free(form->filename);
+	memset(form, 0, sizeof(*form));
+}
+
+int upload_req(CURL *curl,
+	       struct memory_struct *chunk,
+	       const char *url,
+	       const char *dst,
+	       struct upload_stream *upst)
+{
+	int res;
+	struct upload_form form;
+	struct progress_data progress_data = { 0, };
+
+	if (upload_req_setup(curl, chunk, url, dst, upst, &form,
+			     &progress_data))
+		return 1;
+
+	res = http_req_result(curl, chunk, curl_easy_perform(curl));
+	upload_form_cleanup(&form);
 	
 	return res;
 }
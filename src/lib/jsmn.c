@@ -1,4 +1,5 @@
 #include <claud/jsmn.h>
+#include <claud/json_scan.h>
 
 /**
  * Allocates a fresh unused token from the token pool.
@@ -12,6 +13,7 @@ static jsmntok_t *jsmn_alloc_token(jsmn_parser *parser,
 	tok = &tokens[parser->toknext++];
 	tok->start = tok->end = -1;
 	tok->size = 0;
+	tok->span = 1;
 #ifdef JSMN_PARENT_LINKS
 	tok->parent = -1;
 #endif
@@ -90,8 +92,14 @@ static int jsmn_parse_string(jsmn_parser *parser, const char *js,
 	parser->pos++;
 
 	/* Skip starting quote */
-	for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
-		char c = js[parser->pos];
+	for (; ; parser->pos++) {
+		char c;
+
+		/* Skip the plain characters at once */
+		parser->pos = json_scan_string(js, parser->pos, len);
+		if (parser->pos >= len || js[parser->pos] == '\0')
+			break;
+		c = js[parser->pos];
 
 		/* Quote: end of string */
 		if (c == '\"') {
@@ -194,6 +202,7 @@ int jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
 							return JSMN_ERROR_INVAL;
 						}
 						token->end = parser->pos + 1;
+						token->span = parser->toknext - (token - tokens);
 						parser->toksuper = token->parent;
 						break;
 					}
@@ -214,6 +223,7 @@ int jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
 						}
 						parser->toksuper = -1;
 						token->end = parser->pos + 1;
+						token->span = parser->toknext - i;
 						break;
 					}
 				}
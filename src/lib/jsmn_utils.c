@@ -24,53 +24,114 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 #include <malloc.h>
+#include <pthread.h>
 
 #include <claud/jsmn_utils.h>
 #include <claud/utils.h>
 
-/* Function realloc_it() is a wrapper function for standard realloc()
- * with one difference - it frees old memory pointer in case of realloc
- * failure. Thus, DO NOT use old data pointer in anyway after call to
- * realloc_it(). If your code has some kind of fallback algorithm if
- * memory can't be re-allocated - use standard realloc() instead.
+/**
+ * Token storage reused by the parses of a thread, so that parsing
+ * a response does not allocate once the storage is big enough.
+ */
+struct json_pool {
+	jsmntok_t *tok;		/**< The token array */
+	size_t size;		/**< The number of tokens allocated */
+	bool busy;		/**< Whether the array is in use */
+};
+
+static pthread_key_t json_pool_key;
+static pthread_once_t json_pool_once = PTHREAD_ONCE_INIT;
+
+static void json_pool_free(void *arg)
+{
+	struct json_pool *pool = (struct json_pool *)arg;
+	free(pool->tok);
+	free(pool);
+}
+
+static void json_pool_key_init(void)
+{
+	if (pthread_key_create(&json_pool_key, json_pool_free)) {
+		log_error("pthread_key_create() failed\n");
+		exit(1);
+	}
+}
+
+/**
+ * Get the token storage of the calling thread.
+ * @return the token pool.
  */
-static inline void *realloc_it(void *ptrmem, size_t size) {
-	void *p = realloc(ptrmem, size);
-	if (!p)  {
-		free (ptrmem);
-		log_error("realloc(): errno=%d\n", errno);
+static struct json_pool *json_pool_get(void)
+{
+	struct json_pool *pool;
+
+	pthread_once(&json_pool_once, json_pool_key_init);
+	if (!(pool = pthread_getspecific(json_pool_key))) {
+		pool = xcalloc(1, sizeof(*pool));
+		pthread_setspecific(json_pool_key, pool);
 	}
-	return p;
+	return pool;
 }
 
 /**
- * This function counts the nodes of a JSON token tree.
+ * Get storage for the tokens of a parse. The pooled array is used
+ * unless it is taken by a parse still in progress.
+ * @param count - the number of tokens.
+ * @return the token array.
+ */
+static jsmntok_t *json_tokens_get(size_t count)
+{
+	struct json_pool *pool = json_pool_get();
+
+	if (pool->busy)
+		return xmalloc(count * sizeof(jsmntok_t));
+	if (pool->size < count) {
+		free(pool->tok);
+		pool->tok = xmalloc(count * sizeof(*pool->tok));
+		pool->size = count;
+	}
+	pool->busy = true;
+	return pool->tok;
+}
+
+/**
+ * Release the tokens returned by parse_json(). Storage of more than
+ * JSON_POOL_KEEP tokens is freed, so that a huge listing does not pin
+ * its tokens for the lifetime of the thread.
+ * @param tok - the token array, may be NULL.
+ */
+void json_tokens_release(jsmntok_t *tok)
+{
+	struct json_pool *pool;
+
+	if (!tok)
+		return;
+	pool = json_pool_get();
+	if (tok != pool->tok) {
+		free(tok);
+		return;
+	}
+	pool->busy = false;
+	if (pool->size > JSON_POOL_KEEP) {
+		free(pool->tok);
+		pool->tok = NULL;
+		pool->size = 0;
+	}
+}
+
+/**
+ * This function counts the nodes of a JSON token tree. The count
+ * is recorded by the parser when the tree is closed.
  * @param t - the root token.
  * @return the number of the nodes
  */
 size_t get_json_element_count(jsmntok_t *t)
 {
-	int i, j;
-	if (t->type == JSMN_PRIMITIVE) {
-		return 1;
-	} else if (t->type == JSMN_STRING) {
-		return 1;
-	} else if (t->type == JSMN_OBJECT) {
-		j = 0;
-		for (i = 0; i < t->size; i++) {
-			j += get_json_element_count(t+1+j); // keys
-			j += get_json_element_count(t+1+j); // values
-		}
-		return j+1;
-	} else if (t->type == JSMN_ARRAY) {
-		j = 0;
-		for (i = 0; i < t->size; i++) {
-			j += get_json_element_count(t+1+j);
-		}
-		return j+1;
-	}
-	return 0;
+	return t->span;
 }
 
 /**
@@ -85,14 +146,14 @@ size_t get_json_element_count(jsmntok_t *t)
 jsmntok_t *find_json_element_by_name(const char *js, jsmntok_t *t,
 		 size_t count, jsmntype_t type, const char *name)
 {
-	size_t i;
+	size_t i, len = strlen(name);
 	for (i = 0; i < count - 1; i++) {
 		if (type != t[i+1].type)
 			continue;
 		if (JSMN_STRING != t[i].type)
 			continue;
-		if (strncmp(name, js + t[i].start,
-			    t[i].end - t[i].start) == 0)
+		if ((size_t)(t[i].end - t[i].start) == len &&
+		    memcmp(name, js + t[i].start, len) == 0)
 			break;
 	}
 	if (i == count - 1)
@@ -101,77 +162,310 @@ jsmntok_t *find_json_element_by_name(const char *js, jsmntok_t *t,
 	return &t[i+1];
 }
 
+static unsigned int json_hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+/**
+ * Build the hash table of the field names to decode.
+ * @param f - the table;
+ * @param names - the field names, which must stay valid while the table
+ * is used;
+ * @param nr_names - the number of names, at most JSON_FIELDS_MAX.
+ * @return 0 for success, or 1 for too many names.
+ */
+int json_fields_init(struct json_fields *f, const char *const names[],
+		     size_t nr_names)
+{
+	const size_t mask = ARRAY_SIZE(f->slots) - 1;
+	size_t i, slot;
+
+	if (nr_names > JSON_FIELDS_MAX) {
+		log_error("Too many JSON fields: %zu\n", nr_names);
+		return 1;
+	}
+	memset(f, 0, sizeof(*f));
+	f->names = names;
+	f->nr_names = nr_names;
+	for (i = 0; i < nr_names; i++) {
+		slot = json_hash(names[i], strlen(names[i])) & mask;
+		while (f->slots[slot])
+			slot = (slot + 1) & mask;
+		f->slots[slot] = (unsigned char)(i + 1);
+	}
+	return 0;
+}
+
+/**
+ * Find the field name equal to the key.
+ * @param f - the field table;
+ * @param key - the key, not NUL-terminated;
+ * @param len - the key length.
+ * @return the index of the name, or -1 if the key is not decoded.
+ */
+static int json_fields_find(const struct json_fields *f, const char *key,
+			    size_t len)
+{
+	const size_t mask = ARRAY_SIZE(f->slots) - 1;
+	size_t slot = json_hash(key, len) & mask;
+
+	for (; f->slots[slot]; slot = (slot + 1) & mask) {
+		const char *name = f->names[f->slots[slot] - 1];
+		if (!strncmp(name, key, len) && name[len] == '\0')
+			return f->slots[slot] - 1;
+	}
+	return -1;
+}
+
+/**
+ * Find the values of the fields of a JSON object in a single walk
+ * over its direct members. Nested objects are not searched.
+ * @param js - the JSON code;
+ * @param obj - the object;
+ * @param f - the fields to find;
+ * @param values - the array receiving the value of each field,
+ * NULL for the missing ones.
+ * @return the number of tokens of the object subtree.
+ */
+size_t json_object_fields(const char *js, jsmntok_t *obj,
+			  const struct json_fields *f, jsmntok_t *values[])
+{
+	size_t i, count = 1;
+
+	memset(values, 0, f->nr_names * sizeof(*values));
+	if (obj->type != JSMN_OBJECT)
+		return get_json_element_count(obj);
+
+	for (i = 0; i < (size_t)obj->size; i++) {
+		jsmntok_t *key = obj + count;
+		int idx = json_fields_find(f, js + key->start,
+					   key->end - key->start);
+
+		count++;
+		if (idx >= 0 && !values[idx])
+			values[idx] = obj + count;
+		count += get_json_element_count(obj + count);
+	}
+	return count;
+}
+
+/**
+ * Check the type of a token.
+ * @param t - the token, may be NULL;
+ * @param type - the expected type.
+ * @return the token, or NULL if it is of another type.
+ */
+jsmntok_t *json_typed(jsmntok_t *t, jsmntype_t type)
+{
+	return t && t->type == type ? t : NULL;
+}
+
+/**
+ * Parse the integer a token starts with, like sscanf() does, without
+ * copying the token.
+ * @param js - the JSON code;
+ * @param t - the token;
+ * @param val - the value.
+ * @return 0 for success, or 1 if the token is not a number or
+ * the number is out of range.
+ */
+static int json_token_int64(const char *js, jsmntok_t *t, int64_t *val)
+{
+	const char *s = js + t->start, *end = js + t->end;
+	bool neg = false;
+	uint64_t v = 0, max = INT64_MAX;
+
+	if (s < end && *s == '-') {
+		neg = true;
+		max = (uint64_t)INT64_MAX + 1;
+		s++;
+	}
+	if (s == end || *s < '0' || *s > '9')
+		return 1;
+	for (; s < end && *s >= '0' && *s <= '9'; s++) {
+		unsigned int d = *s - '0';
+		if (v > (max - d) / 10)
+			return 1;
+		v = v * 10 + d;
+	}
+	*val = neg ? (int64_t)(0 - v) : (int64_t)v;
+	return 0;
+}
+
+/**
+ * Parse a true or false token.
+ * @param js - the JSON code;
+ * @param t - the token;
+ * @param val - the value.
+ * @return 0 for success, or 1 if the token is not a bool.
+ */
+static int json_token_bool(const char *js, jsmntok_t *t, bool *val)
+{
+	size_t len = (size_t)(t->end - t->start);
+
+	if (len == 4 && !memcmp("true", js + t->start, 4))
+		*val = true;
+	else if (len == 5 && !memcmp("false", js + t->start, 5))
+		*val = false;
+	else
+		return 1;
+	return 0;
+}
+
+/**
+ * Build a decoder from a table of field descriptors.
+ * @param d - the decoder, which must not be moved while it is used;
+ * @param fields - the field table, which must stay valid while
+ * the decoder is used;
+ * @param nr_fields - the number of fields, at most JSON_FIELDS_MAX.
+ * @return 0 for success, or 1 for too many fields.
+ */
+int json_decoder_init(struct json_decoder *d, const struct json_field fields[],
+		      size_t nr_fields)
+{
+	size_t i;
+
+	if (nr_fields > JSON_FIELDS_MAX) {
+		log_error("Too many JSON fields: %zu\n", nr_fields);
+		return 1;
+	}
+	d->fields = fields;
+	for (i = 0; i < nr_fields; i++)
+		d->names[i] = fields[i].name;
+	return json_fields_init(&d->index, d->names, nr_fields);
+}
+
+/**
+ * Decode a value to a struct member.
+ * @param js - the JSON code;
+ * @param t - the value;
+ * @param field - the field descriptor;
+ * @param dst - the struct;
+ * @param ctx - the context of the custom decoders.
+ * @return 0 for success, or 1 if the value is malformed.
+ */
+static int json_decode_value(const char *js, jsmntok_t *t,
+			     const struct json_field *field, void *dst,
+			     void *ctx)
+{
+	void *member = (char *)dst + field->offset;
+	struct json_decoder sub;
+	int64_t val;
+
+	switch (field->type) {
+	case JSON_INT:
+		if (t->type != JSMN_PRIMITIVE || json_token_int64(js, t, &val) ||
+		    val < INT_MIN || val > INT_MAX)
+			return 1;
+		*(int *)member = (int)val;
+		return 0;
+	case JSON_INT64:
+		if (t->type != JSMN_PRIMITIVE || json_token_int64(js, t, &val))
+			return 1;
+		*(int64_t *)member = val;
+		return 0;
+	case JSON_TIME:
+		if (t->type != JSMN_PRIMITIVE || json_token_int64(js, t, &val))
+			return 1;
+		*(time_t *)member = (time_t)val;
+		return 0;
+	case JSON_BOOL:
+		if (t->type != JSMN_PRIMITIVE)
+			return 1;
+		return json_token_bool(js, t, (bool *)member);
+	case JSON_STRING:
+		if (t->type != JSMN_STRING)
+			return 1;
+		*(char **)member = xstrndup(js + t->start, t->end - t->start);
+		return 0;
+	case JSON_OBJECT:
+		if (json_decoder_init(&sub, field->fields, field->nr_fields))
+			return 1;
+		return json_decode_object(js, t, &sub, dst, ctx);
+	case JSON_CUSTOM:
+		return field->decode(js, t, member, ctx);
+	}
+	return 1;
+}
+
+/**
+ * Decode the fields of a JSON object to a struct in a single walk
+ * over the object members. The members of the missing optional fields
+ * and of the optional fields of a wrong type are left untouched.
+ * @param js - the JSON code;
+ * @param obj - the object;
+ * @param d - the decoder;
+ * @param dst - the struct;
+ * @param ctx - the context passed to the custom decoders.
+ * @return 0 for success, or 1 if the token is not an object, or
+ * a required field is missing or malformed.
+ */
+int json_decode_object(const char *js, jsmntok_t *obj,
+		       const struct json_decoder *d, void *dst, void *ctx)
+{
+	jsmntok_t *values[JSON_FIELDS_MAX];
+	size_t i;
+
+	if (obj->type != JSMN_OBJECT)
+		return 1;
+
+	json_object_fields(js, obj, &d->index, values);
+	for (i = 0; i < d->index.nr_names; i++) {
+		const struct json_field *field = &d->fields[i];
+
+		if (values[i] &&
+		    !json_decode_value(js, values[i], field, dst, ctx))
+			continue;
+		if (field->required)
+			return 1;
+	}
+	return 0;
+}
+
 int parse_json_int(const char *js, jsmntok_t *t)
 {
-	int val = 0;
-	size_t len;
-	char *buf;
+	int64_t val;
 
 	if (!js || !t)
 		return 0;
 
-	len = (size_t)(t->end - t->start);
-	
-	buf = malloc(len+1);
-	if (!buf) {
-		log_error("Failed to alloc memory\n");
-		return 0;
-	}
-	strncpy(buf, js + t->start, len);
-	buf[len] = '\0';
-	if (sscanf(buf, "%d", &val) <= 0) {
+	if (json_token_int64(js, t, &val) || val < INT_MIN || val > INT_MAX) {
 		log_error("Could not parse int value\n");
-		val = 0;
+		return 0;
 	}
-	free(buf);
-	return val;
+	return (int)val;
 }
 
 int64_t parse_json_int64(const char *js, jsmntok_t *t)
 {
-	int64_t val = 0;
-	size_t len;
-	char *buf;
-	
+	int64_t val;
+
 	if (!js || !t)
 		return 0;
 
-	len = (size_t)(t->end - t->start);
-	
-	buf = malloc(len+1);
-	if (!buf) {
-		log_error("Failed to alloc memory\n");
-		return 0;
-	}
-	
-	strncpy(buf, js + t->start, len);
-	buf[len] = '\0';
-	if (sscanf(buf, "%ld", &val) <= 0) {
+	if (json_token_int64(js, t, &val)) {
 		log_error("Could not parse 64-bit int value\n");
-		val = 0;
+		return 0;
 	}
-	free(buf);
 	return val;
 }
 
 bool parse_json_bool(const char *js, jsmntok_t *t)
 {
 	bool val = false;
-	size_t len;
-	char *buf;
 
 	if (!js || !t)
 		return 0;
 
-	len = (size_t)(t->end - t->start);
-	
-	if (!strncmp("true", js + t->start, len))
-		val = true;
-	else if (!strncmp("false", js + t->start, len))
-		val = false;
-	else
-		log_error("Wrong bool value: %.*s\n", len, js + t->start);
-
+	if (json_token_bool(js, t, &val))
+		log_error("Wrong bool value: %.*s\n", t->end - t->start,
+			  js + t->start);
 	return val;
 }
 
@@ -184,39 +478,51 @@ char *parse_json_string(const char *js, jsmntok_t *t)
 }
 
 /**
- * Allocate a JSON token array, parse the memory buffer into tokens and
- * put them into the token array. Return a pointer to the token array and
- * the number of parsed tokens.
+ * Copy a JSON string to an arena.
+ * @param js - the JSON code;
+ * @param t - the string token, may be NULL;
+ * @param a - the arena.
+ * @return the copy, or NULL if there is no token.
+ */
+char *parse_json_arena_string(const char *js, jsmntok_t *t, struct arena *a)
+{
+	if (!js || !t)
+		return NULL;
+
+	return arena_strndup(a, js + t->start, t->end - t->start);
+}
+
+/**
+ * Parse the memory buffer into JSON tokens. The tokens are counted
+ * first, so the buffer is parsed once into storage of the exact size,
+ * taken from the token pool of the thread.
  * @param p - the parser;
  * @param buf - the memory buffer containing JSON code;
  * @param buf_size - the size of the memory buffer;
  * @param count - the pointer used to return the number of parsed tokens;
- * @return a pointer to the JSON token array.
+ * @return a pointer to the JSON token array, to be released with
+ * json_tokens_release(), or NULL if the buffer holds no valid JSON.
  */
 jsmntok_t *parse_json(jsmn_parser *p, const char *buf, size_t buf_size,
 		      size_t *count)
 {
-	int r = 0;
-	jsmntok_t *tok = NULL;
-	size_t tokcount = 1;
-
-	do {
-		tokcount = tokcount * 2;
-		tok = realloc_it(tok, sizeof(jsmntok_t) * tokcount);
-		if (tok == NULL) {
-			*count = 0;
-			log_error("Could not allocate JSON tokens!\n");
-			return NULL;
-		}
-		r = jsmn_parse(p, buf, buf_size, tok, tokcount);
-	} while (r == JSMN_ERROR_NOMEM);
-	
-	if (r < 0) {
-		free(tok);
-		tokcount = 0;
+	jsmn_parser counter = *p;
+	jsmntok_t *tok;
+	int r;
+
+	*count = 0;
+	r = jsmn_parse(&counter, buf, buf_size, NULL, 0);
+	if (r <= 0)
+		return NULL;
+
+	tok = json_tokens_get(r);
+	r = jsmn_parse(p, buf, buf_size, tok, r);
+	if (r <= 0) {
+		json_tokens_release(tok);
+		return NULL;
 	}
-	
-	*count = tokcount;
+
+	*count = r;
 	return tok;
 }
 
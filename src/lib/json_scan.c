@@ -0,0 +1,152 @@
+/**
+ * @file json_scan.c
+ * Vectorized JSON string scanning for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Only the bodies of strings are scanned with vector instructions,
+ * they are most of the bytes of the API responses. Whitespace and
+ * the structural characters are still handled one byte at a time
+ * by the parsers, there is no structural character bitmap: the
+ * responses are compact, so the bytes outside strings are the
+ * structural characters themselves and short numbers.
+ */
+
+#include <stddef.h>
+#include <claud/json_scan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Check whether a character ends the plain run of a string.
+ * @param c - the character.
+ * @return true for a quote, a backslash or NUL.
+ */
+static inline int json_string_special(char c)
+{
+	return c == '"' || c == '\\' || c == '\0';
+}
+
+static size_t scan_string_scalar(const char *js, size_t pos, size_t len)
+{
+	while (pos < len && !json_string_special(js[pos]))
+		pos++;
+	return pos;
+}
+
+#ifdef __SSE2__
+/**
+ * Find the special characters of 16 bytes.
+ * @param p - the bytes.
+ * @return the bit mask of the special characters.
+ */
+static inline unsigned int sse2_special_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+			     _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+		_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	return (unsigned int)_mm_movemask_epi8(m);
+}
+
+static size_t scan_string_sse2(const char *js, size_t pos, size_t len)
+{
+	for (; pos + 16 <= len; pos += 16) {
+		unsigned int mask = sse2_special_mask(js + pos);
+		if (mask)
+			return pos + __builtin_ctz(mask);
+	}
+	return scan_string_scalar(js, pos, len);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int avx2_special_mask(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i m = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+		_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	return (unsigned int)_mm256_movemask_epi8(m);
+}
+
+/*
+ * Two 32-byte blocks are checked per step. The tail is not left to
+ * the SSE2 variant, legacy SSE code run with the upper halves of the
+ * AVX registers in use is heavily penalized.
+ */
+__attribute__((target("avx2")))
+static size_t scan_string_avx2(const char *js, size_t pos, size_t len)
+{
+	unsigned int mask;
+
+	for (; pos + 64 <= len; pos += 64) {
+		unsigned long long mask2 = avx2_special_mask(js + pos) |
+			(unsigned long long)avx2_special_mask(js + pos + 32) << 32;
+		if (mask2)
+			return pos + __builtin_ctzll(mask2);
+	}
+	if (pos + 32 <= len) {
+		if ((mask = avx2_special_mask(js + pos)))
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+	return scan_string_scalar(js, pos, len);
+}
+#endif /* __SSE2__ */
+
+typedef size_t (*scan_string_fn)(const char *js, size_t pos, size_t len);
+
+static size_t scan_string_resolve(const char *js, size_t pos, size_t len);
+
+/** The implementation for the CPU, resolved on the first call */
+static scan_string_fn scan_string_impl = scan_string_resolve;
+
+static size_t scan_string_resolve(const char *js, size_t pos, size_t len)
+{
+	scan_string_fn fn = scan_string_scalar;
+
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	fn = __builtin_cpu_supports("avx2")
+		? scan_string_avx2 : scan_string_sse2;
+#endif
+	/* All threads resolve the same function */
+	__atomic_store_n(&scan_string_impl, fn, __ATOMIC_RELAXED);
+	return fn(js, pos, len);
+}
+
+/**
+ * Skip the plain characters of a JSON string. Long strings are
+ * checked in blocks of 16 to 64 bytes with the widest vector
+ * instructions the CPU supports.
+ * @param js - the JSON code;
+ * @param pos - the position inside the string to start at;
+ * @param len - the code length.
+ * @return the position of the first quote, backslash or NUL character
+ * at or after pos, or len if there is none.
+ */
+size_t json_scan_string(const char *js, size_t pos, size_t len)
+{
+	return __atomic_load_n(&scan_string_impl, __ATOMIC_RELAXED)(js, pos,
+								    len);
+}
@@ -0,0 +1,223 @@
+/**
+ * @file json_stream.c
+ * Incremental JSON array splitter for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <claud/json_scan.h>
+#include <claud/json_stream.h>
+#include <claud/utils.h>
+
+/**
+ * Initialize a stream.
+ * @param s - the stream;
+ * @param path - the object keys leading from the root to the array;
+ * @param nr_path - the number of keys, 0 if the root is the array;
+ * @param on_element - the callback receiving the object elements;
+ * @param arg - the callback argument.
+ */
+void json_stream_init(struct json_stream *s, const char *const path[],
+		      size_t nr_path, json_element_cb on_element, void *arg)
+{
+	memset(s, 0, sizeof(*s));
+	s->path = path;
+	s->nr_path = nr_path;
+	s->on_element = on_element;
+	s->arg = arg;
+	strbuf_init(&s->elem);
+}
+
+/**
+ * Prepare the stream for a new document, e.g. when a request
+ * is retried.
+ * @param s - the stream.
+ */
+void json_stream_reset(struct json_stream *s)
+{
+	struct strbuf elem = s->elem;
+	const char *const *path = s->path;
+	size_t nr_path = s->nr_path;
+	json_element_cb on_element = s->on_element;
+	void *arg = s->arg;
+
+	memset(s, 0, sizeof(*s));
+	s->path = path;
+	s->nr_path = nr_path;
+	s->on_element = on_element;
+	s->arg = arg;
+	s->elem = elem;
+	strbuf_reset(&s->elem);
+}
+
+void json_stream_cleanup(struct json_stream *s)
+{
+	strbuf_cleanup(&s->elem);
+}
+
+/**
+ * Pass a complete element to the callback.
+ * @param s - the stream;
+ * @param js - the end of the element code in the fed data;
+ * @param len - the length of the code in the fed data.
+ * @return 0 for success, or 1 if the callback failed.
+ */
+static int json_stream_emit(struct json_stream *s, const char *js, size_t len)
+{
+	int res;
+
+	/* The beginning came with the previous pieces */
+	if (s->elem.len) {
+		strbuf_append(&s->elem, js, len);
+		js = s->elem.buf;
+		len = s->elem.len;
+	}
+	s->in_elem = false;
+	res = s->on_element(s->arg, js, len);
+	strbuf_reset(&s->elem);
+	return res ? 1 : 0;
+}
+
+/**
+ * Account a character of a string.
+ * @param s - the stream;
+ * @param ch - the character.
+ */
+static inline void json_stream_string(struct json_stream *s, char ch)
+{
+	if (s->escape) {
+		s->escape = false;
+		return;
+	}
+	if (ch == '\\') {
+		/* The path keys have no escapes */
+		s->escape = true;
+		s->key_match = false;
+	} else if (ch == '"') {
+		s->in_string = false;
+		if (s->in_key)
+			s->key_hit = s->key_match &&
+				!s->path[s->depth - 1][s->key_pos];
+	} else if (s->in_key && s->key_match) {
+		s->key_match = s->path[s->depth - 1][s->key_pos++] == ch;
+	}
+}
+
+/**
+ * Feed the next piece of the document to the stream. The elements
+ * completed by the piece are passed to the callback before the
+ * function returns.
+ * @param s - the stream;
+ * @param data - the piece of the document;
+ * @param len - the piece length.
+ * @return 0 for success, or 1 if the document is malformed or
+ * the callback failed.
+ */
+int json_stream_feed(struct json_stream *s, const char *data, size_t len)
+{
+	size_t start = 0, i;
+	/* The depth of the containers that are the elements */
+	size_t elem_depth = s->nr_path + 1;
+
+	if (s->failed)
+		return 1;
+
+	for (i = 0; i < len; i++) {
+		char ch;
+
+		if (s->in_string) {
+			/* Only the keys on the path are looked at */
+			if (!s->in_key && !s->escape &&
+			    (i = json_scan_string(data, i, len)) == len)
+				break;
+			json_stream_string(s, data[i]);
+			continue;
+		}
+		ch = data[i];
+		switch (ch) {
+		case '"':
+			s->in_string = true;
+			s->in_key = s->expect_key && s->matched == s->depth &&
+				s->depth && s->depth <= s->nr_path;
+			s->key_match = true;
+			s->key_pos = 0;
+			s->expect_key = false;
+			break;
+		case '{':
+		case '[':
+			if (s->matched == s->depth &&
+			    (!s->depth || s->key_hit) &&
+			    ch == (s->depth < s->nr_path ? '{' : '[') &&
+			    s->depth <= s->nr_path) {
+				s->matched++;
+				if (s->matched == elem_depth)
+					s->found = true;
+			} else if (s->matched == s->depth &&
+				   s->depth == elem_depth && ch == '{') {
+				s->in_elem = true;
+				start = i;
+			}
+			s->depth++;
+			s->expect_key = ch == '{';
+			s->key_hit = false;
+			break;
+		case '}':
+		case ']':
+			if (!s->depth) {
+				log_error("Unbalanced JSON brackets\n");
+				s->failed = true;
+				return 1;
+			}
+			s->depth--;
+			if (s->matched > s->depth)
+				s->matched = s->depth;
+			s->expect_key = false;
+			s->key_hit = false;
+			if (s->in_elem && s->depth == elem_depth &&
+			    json_stream_emit(s, data + start, i + 1 - start)) {
+				s->failed = true;
+				return 1;
+			}
+			break;
+		case ',':
+			s->expect_key = true;
+			s->key_hit = false;
+			break;
+		case ':':
+			s->expect_key = false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (s->in_elem)
+		strbuf_append(&s->elem, data + start, len - start);
+	return 0;
+}
+
+/**
+ * Check that the whole document has been fed.
+ * @param s - the stream.
+ * @return 0 if the document is complete and the array was found,
+ * or 1 otherwise.
+ */
+int json_stream_finish(struct json_stream *s)
+{
+	return s->failed || s->depth || s->in_string || !s->found;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file mem_budget.c
+ * Memory budget of transfer buffers for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <claud/mem_budget.h>
+
+void mem_budget_init(struct mem_budget *b, size_t limit)
+{
+	memset(b, 0, sizeof(*b));
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->freed, NULL);
+	b->limit = limit;
+}
+
+void mem_budget_cleanup(struct mem_budget *b)
+{
+	pthread_cond_destroy(&b->freed);
+	pthread_mutex_destroy(&b->lock);
+}
+
+/**
+ * Change the budget. Reservations made before are kept. The budget
+ * is not changed by mem_budget_set_default() any more.
+ * @param b - the memory budget;
+ * @param limit - the new budget in bytes.
+ */
+void mem_budget_set_limit(struct mem_budget *b, size_t limit)
+{
+	pthread_mutex_lock(&b->lock);
+	b->limit = limit;
+	b->fixed = true;
+	pthread_cond_broadcast(&b->freed);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Get the default budget for the specified number of parallel
+ * transfers.
+ * @param max_concurrency - the upper bound of parallel transfers.
+ * @return the budget in bytes.
+ */
+size_t mem_budget_default(int max_concurrency)
+{
+	size_t limit = (size_t)max_concurrency * MEM_BUDGET_PER_TRANSFER;
+	return limit < MEM_BUDGET_DEFAULT_MAX ? limit : MEM_BUDGET_DEFAULT_MAX;
+}
+
+/**
+ * Change the budget unless it was set with mem_budget_set_limit().
+ * @param b - the memory budget;
+ * @param limit - the new budget in bytes.
+ */
+void mem_budget_set_default(struct mem_budget *b, size_t limit)
+{
+	pthread_mutex_lock(&b->lock);
+	if (!b->fixed) {
+		b->limit = limit;
+		pthread_cond_broadcast(&b->freed);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+static bool mem_budget_fits(const struct mem_budget *b, size_t size)
+{
+	return !b->used || b->used + size <= b->limit;
+}
+
+static void mem_budget_take(struct mem_budget *b, size_t size)
+{
+	b->used += size;
+	if (b->used > b->peak)
+		b->peak = b->used;
+}
+
+/**
+ * Reserve memory if the budget allows it.
+ * @param b - the memory budget;
+ * @param size - the size to reserve.
+ * @return true if the memory was reserved.
+ */
+bool mem_budget_try(struct mem_budget *b, size_t size)
+{
+	bool res;
+
+	pthread_mutex_lock(&b->lock);
+	if ((res = mem_budget_fits(b, size)))
+		mem_budget_take(b, size);
+	pthread_mutex_unlock(&b->lock);
+	return res;
+}
+
+/**
+ * Reserve memory, waiting for other transfers to release it.
+ * @param b - the memory budget;
+ * @param size - the size to reserve.
+ */
+void mem_budget_acquire(struct mem_budget *b, size_t size)
+{
+	pthread_mutex_lock(&b->lock);
+	while (!mem_budget_fits(b, size))
+		pthread_cond_wait(&b->freed, &b->lock);
+	mem_budget_take(b, size);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Reserve memory without waiting, even beyond the budget. It is meant
+ * for requests the transfers themselves may wait for, such as metadata
+ * requests: they are accounted for, but never blocked.
+ * @param b - the memory budget;
+ * @param size - the size to reserve.
+ */
+void mem_budget_charge(struct mem_budget *b, size_t size)
+{
+	pthread_mutex_lock(&b->lock);
+	mem_budget_take(b, size);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Release reserved memory.
+ * @param b - the memory budget;
+ * @param size - the reserved size.
+ */
+void mem_budget_release(struct mem_budget *b, size_t size)
+{
+	pthread_mutex_lock(&b->lock);
+	b->used -= size < b->used ? size : b->used;
+	pthread_cond_broadcast(&b->freed);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Get the highest amount of memory reserved at once.
+ * @param b - the memory budget.
+ * @return the amount in bytes.
+ */
+size_t mem_budget_peak(struct mem_budget *b)
+{
+	size_t peak;
+
+	pthread_mutex_lock(&b->lock);
+	peak = b->peak;
+	pthread_mutex_unlock(&b->lock);
+	return peak;
+}
@@ -0,0 +1,390 @@
+/**
+ * @file shards.c
+ * Shard selection for Mail.Ru Cloud access library.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/shards.h>
+#include <claud/utils.h>
+
+static void shard_free(struct shard *sh)
+{
+	free(sh->url);
+	free(sh);
+}
+
+static void shard_list_cleanup(struct shard_list *list)
+{
+	size_t i;
+	for (i = 0; i < list->size; i++)
+		shard_free(list->items[i]);
+	free(list->items);
+	list->items = NULL;
+	list->size = 0;
+}
+
+/**
+ * Initialize an empty shard set.
+ * @param set - the shard set.
+ */
+void shard_set_init(struct shard_set *set)
+{
+	memset(set, 0, sizeof(*set));
+	pthread_mutex_init(&set->lock, NULL);
+}
+
+void shard_set_cleanup(struct shard_set *set)
+{
+	shard_list_cleanup(&set->get);
+	shard_list_cleanup(&set->upload);
+	shard_list_cleanup(&set->retired);
+	pthread_mutex_destroy(&set->lock);
+}
+
+/**
+ * Remove a shard from the retired list, called under the set lock.
+ * @param set - the shard set;
+ * @param sh - the retired shard.
+ */
+static void shard_unretire(struct shard_set *set, struct shard *sh)
+{
+	size_t i;
+	for (i = 0; i < set->retired.size; i++) {
+		if (set->retired.items[i] == sh) {
+			set->retired.items[i] =
+				set->retired.items[--set->retired.size];
+			return;
+		}
+	}
+}
+
+/**
+ * Replace the shard list with the shards returned by the dispatcher.
+ * The shards which are still listed are kept with their statistics,
+ * the others are freed, or moved to the retired list while transfers
+ * still run on them. The URLs are moved from the shard item array.
+ * @param set - the shard set;
+ * @param list - the shard list;
+ * @param arr - the shard items.
+ */
+static void shard_list_update(struct shard_set *set, struct shard_list *list,
+			      struct shard_item_array *arr)
+{
+	struct shard_list *retired = &set->retired;
+	struct shard **items = xcalloc(arr->size, sizeof(*items));
+	size_t i, j;
+
+	for (i = 0; i < arr->size; i++) {
+		for (j = 0; j < list->size; j++) {
+			if (list->items[j] &&
+			    !strcmp(list->items[j]->url, arr->items[i].url)) {
+				items[i] = list->items[j];
+				list->items[j] = NULL;
+				break;
+			}
+		}
+		if (!items[i]) {
+			items[i] = xcalloc(1, sizeof(*items[i]));
+			items[i]->set = set;
+			items[i]->url = arr->items[i].url;
+			arr->items[i].url = NULL;
+		}
+	}
+	for (j = 0; j < list->size; j++) {
+		if (!list->items[j])
+			continue;
+		if (!list->items[j]->inflight) {
+			shard_free(list->items[j]);
+			continue;
+		}
+		list->items[j]->retired = true;
+		retired->items = xrealloc(retired->items,
+			(retired->size + 1) * sizeof(*retired->items));
+		retired->items[retired->size++] = list->items[j];
+	}
+	free(list->items);
+	list->items = items;
+	list->size = arr->size;
+}
+
+/**
+ * Update the shard set with the dispatcher response.
+ * @param set - the shard set;
+ * @param s - the shard info, its URLs are taken over.
+ */
+void shard_set_update(struct shard_set *set, struct shard_info *s)
+{
+	pthread_mutex_lock(&set->lock);
+	shard_list_update(set, &set->get, &s->body.get);
+	shard_list_update(set, &set->upload, &s->body.upload);
+	set->expires = get_time_ms() + SHARD_CACHE_TTL_MS;
+	pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Check whether the cached shard set can be used without asking
+ * the dispatcher.
+ * @param set - the shard set.
+ * @return true if the set is filled in and not expired.
+ */
+bool shard_set_valid(struct shard_set *set)
+{
+	bool valid;
+
+	pthread_mutex_lock(&set->lock);
+	valid = set->get.size && set->upload.size &&
+		get_time_ms() < set->expires;
+	pthread_mutex_unlock(&set->lock);
+	return valid;
+}
+
+/**
+ * Make the next cld_get_shard_info() call ask the dispatcher again.
+ * The shards and their statistics are kept until then.
+ * @param set - the shard set.
+ */
+void shard_set_invalidate(struct shard_set *set)
+{
+	pthread_mutex_lock(&set->lock);
+	set->expires = 0;
+	pthread_mutex_unlock(&set->lock);
+}
+
+static inline void update_avg_long(long *avg, long sample)
+{
+	*avg = *avg
+		? (*avg * (100 - SHARD_EWMA_WEIGHT) +
+		   sample * SHARD_EWMA_WEIGHT) / 100
+		: sample;
+}
+
+static inline void update_avg_double(double *avg, double sample)
+{
+	*avg = *avg
+		? (*avg * (100 - SHARD_EWMA_WEIGHT) +
+		   sample * SHARD_EWMA_WEIGHT) / 100
+		: sample;
+}
+
+static void shard_list_probe(struct shard_list *list, const char *host_url,
+			     long rtt_us)
+{
+	size_t i, len = strlen(host_url);
+	for (i = 0; i < list->size; i++)
+		if (!strncmp(list->items[i]->url, host_url, len))
+			update_avg_long(&list->items[i]->rtt_us, rtt_us);
+}
+
+/**
+ * Account a round-trip time measured to a shard host.
+ * @param set - the shard set;
+ * @param host_url - the root URL of the host;
+ * @param rtt_us - the round-trip time.
+ */
+void shard_set_probe(struct shard_set *set, const char *host_url,
+		     long rtt_us)
+{
+	if (rtt_us <= 0)
+		return;
+	pthread_mutex_lock(&set->lock);
+	shard_list_probe(&set->get, host_url, rtt_us);
+	shard_list_probe(&set->upload, host_url, rtt_us);
+	pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Estimate the time a reference transfer would take on the shard,
+ * queued behind its running transfers. Shards without measurements
+ * get zero, so they are tried first.
+ * @param sh - the shard.
+ * @return the estimated time in microseconds.
+ */
+static double shard_cost(const struct shard *sh)
+{
+	double cost = sh->rtt_us;
+	if (sh->speed > 0)
+		cost += SHARD_REF_SIZE * 1e6 / sh->speed;
+	return cost * (1 + sh->inflight);
+}
+
+/**
+ * Select the shard expected to be the fastest for a new transfer.
+ * Shards that failed recently are avoided unless all of them did.
+ * The transfer is accounted on the shard right away, so that it
+ * stays allocated; shard_end() must be called when it ends.
+ * @param set - the shard set;
+ * @param list - the shard list of the set.
+ * @return the shard, or NULL if the list is empty.
+ */
+struct shard *shard_select(struct shard_set *set, struct shard_list *list)
+{
+	struct shard *best = NULL;
+	bool best_penalized = true;
+	int64_t now = get_time_ms();
+	size_t i;
+
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; i < list->size; i++) {
+		struct shard *sh = list->items[i];
+		bool penalized = sh->penalty_until > now;
+
+		if (best && penalized && !best_penalized)
+			continue;
+		if (!best || (!penalized && best_penalized) ||
+		    shard_cost(sh) < shard_cost(best)) {
+			best = sh;
+			best_penalized = penalized;
+		}
+	}
+	if (best)
+		best->inflight++;
+	pthread_mutex_unlock(&set->lock);
+	return best;
+}
+
+/**
+ * Account the end of a transfer on the shard, called under the set
+ * lock.
+ * @param sh - the shard.
+ * @return true if the shard is retired and no longer used, so
+ * the caller has to free it.
+ */
+static bool shard_put(struct shard *sh)
+{
+	if (--sh->inflight || !sh->retired)
+		return false;
+	shard_unretire(sh->set, sh);
+	return true;
+}
+
+/**
+ * Account a transfer finished on the shard and update its statistics
+ * from the transfer info. A retired shard is freed with its last
+ * transfer, so the shard must not be used after the call.
+ * @param sh - the shard;
+ * @param curl - the handle used for the transfer;
+ * @param res - the transfer result, 0 for success, or SHARD_CANCELLED
+ * for a transfer cancelled by the client, which tells nothing about
+ * the shard and leaves its statistics alone.
+ * @return 1 if the transfer failed because of the shard, otherwise 0.
+ */
+int shard_end(struct shard *sh, CURL *curl, int res)
+{
+	curl_off_t connect = 0, lookup = 0, speed = 0, size = 0;
+	struct shard_set *set = sh->set;
+	long code = 0;
+	int nr_errors;
+	bool unused;
+
+	if (res == SHARD_CANCELLED) {
+		pthread_mutex_lock(&set->lock);
+		unused = shard_put(sh);
+		pthread_mutex_unlock(&set->lock);
+		if (unused)
+			shard_free(sh);
+		return 0;
+	}
+	if (res) {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		pthread_mutex_lock(&set->lock);
+		/* Client errors are not the shard's fault */
+		if (code >= 400 && code < 500) {
+			unused = shard_put(sh);
+			pthread_mutex_unlock(&set->lock);
+			if (unused)
+				shard_free(sh);
+			return 0;
+		}
+		nr_errors = ++sh->nr_errors;
+		sh->penalty_until = get_time_ms() +
+			((int64_t)SHARD_PENALTY_MS <<
+			 (nr_errors < 5 ? nr_errors - 1 : 4));
+		log_warn("Shard %s failed, %d errors in a row\n",
+			 sh->url, nr_errors);
+		unused = shard_put(sh);
+		pthread_mutex_unlock(&set->lock);
+		if (unused)
+			shard_free(sh);
+		return 1;
+	}
+
+	/* The TCP handshake takes one round trip */
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+	curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+	if (size < SHARD_MIN_SPEED_SAMPLE) {
+		curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &size);
+		curl_easy_getinfo(curl, CURLINFO_SPEED_UPLOAD_T, &speed);
+	}
+
+	pthread_mutex_lock(&set->lock);
+	sh->nr_errors = 0;
+	sh->penalty_until = 0;
+	if (connect > lookup)
+		update_avg_long(&sh->rtt_us, (long)(connect - lookup));
+	if (size >= SHARD_MIN_SPEED_SAMPLE && speed > 0)
+		update_avg_double(&sh->speed, (double)speed);
+	unused = shard_put(sh);
+	pthread_mutex_unlock(&set->lock);
+	if (unused)
+		shard_free(sh);
+
+	return 0;
+}
+
+/**
+ * Size the transfer buffers for the bandwidth-delay product of
+ * the shard. Twice the product is used, as the measured throughput
+ * is itself limited by the buffers. The sizes are left as they are
+ * until the shard has been measured.
+ * @param sh - the shard;
+ * @param buf_size - the CURL buffer size;
+ * @param sock_buf_size - the socket buffer size, set to 0 to keep
+ * the kernel autotuning.
+ */
+void shard_buffer_sizes(struct shard *sh, size_t *buf_size,
+			size_t *sock_buf_size)
+{
+	double bdp;
+
+	pthread_mutex_lock(&sh->set->lock);
+	bdp = 2 * sh->speed * sh->rtt_us / 1e6;
+	pthread_mutex_unlock(&sh->set->lock);
+	if (bdp <= 0)
+		return;
+
+	if (bdp < SHARD_MIN_BUFFER)
+		*buf_size = SHARD_MIN_BUFFER;
+	else if (bdp > SHARD_MAX_BUFFER)
+		*buf_size = SHARD_MAX_BUFFER;
+	else
+		*buf_size = (size_t)bdp;
+
+	if (bdp < SHARD_MIN_SOCK_BUFFER)
+		*sock_buf_size = 0;
+	else if (bdp > SHARD_MAX_SOCK_BUFFER)
+		*sock_buf_size = SHARD_MAX_SOCK_BUFFER;
+	else
+		*sock_buf_size = (size_t)bdp;
+}
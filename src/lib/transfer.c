@@ -0,0 +1,728 @@
+/**
+ * @file transfer.c
+ * Parallel transfer engine for Mail.Ru Cloud access library.
+ *
+ * Downloads are split into ranged segments and upload parts are sent
+ * side by side over pooled connections. The number of parallel
+ * transfers is driven by an AIMD controller: it grows by one while
+ * the aggregate throughput keeps improving and is halved when the
+ * server throttles or its latency spikes.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+#include <claud/bwlimit.h>
+#include <claud/mem_budget.h>
+#include <claud/cld.h>
+#include <claud/conn_pool.h>
+#include <claud/shards.h>
+#include <claud/thread.h>
+#include <claud/transfer.h>
+#include <claud/utils.h>
+
+/**
+ * The state of the jobs of a file used for scheduling.
+ */
+struct xfer_flow {
+	int running;		/**< The number of running jobs */
+	uint64_t left;		/**< The bytes left to transfer */
+};
+
+void xfer_init(struct xfer *x)
+{
+	memset(x, 0, sizeof(*x));
+	pthread_mutex_init(&x->run_lock, NULL);
+	pthread_mutex_init(&x->lock, NULL);
+	x->aimd.level = XFER_START_CONCURRENCY;
+	x->aimd.max = XFER_DEFAULT_MAX_CONCURRENCY;
+}
+
+void xfer_cleanup(struct xfer *x)
+{
+	if (x->multi)
+		curl_multi_cleanup(x->multi);
+	pthread_mutex_destroy(&x->lock);
+	pthread_mutex_destroy(&x->run_lock);
+}
+
+/**
+ * Initialize a transfer job.
+ * @param job - the job;
+ * @param kind - the transfer type;
+ * @param path - the remote file path, which must stay valid
+ * while the job exists.
+ */
+void xfer_job_init(struct xfer_job *job, enum xfer_kind kind,
+		   const char *path)
+{
+	memset(job, 0, sizeof(*job));
+	job->kind = kind;
+	job->path = path;
+	job->fd = -1;
+	memory_struct_init(&job->chunk);
+}
+
+void xfer_job_cleanup(struct xfer_job *job)
+{
+	memory_struct_cleanup(&job->chunk);
+}
+
+/**
+ * Decrease the concurrency level multiplicatively. Only one decrease
+ * is made per window, as the running transfers usually react
+ * to the same congestion. Called with the engine lock held.
+ * @param x - the transfer engine;
+ * @param reason - the reason logged.
+ */
+static void aimd_cut(struct xfer *x, const char *reason)
+{
+	struct aimd *a = &x->aimd;
+	int64_t now = get_time_ms();
+
+	if (now - a->last_cut < AIMD_WINDOW_MS)
+		return;
+	a->last_cut = now;
+	a->level = a->level * AIMD_DECREASE / 100;
+	if (a->level < 1)
+		a->level = 1;
+	/* The throughput has to be measured anew at the lower level */
+	a->prev_rate = 0;
+	x->stats.nr_cuts++;
+	log_debug("Concurrency decreased to %d: %s\n", a->level, reason);
+}
+
+/**
+ * Account the time to the first byte of a download and decrease
+ * the concurrency level if it spiked. Called with the engine lock held.
+ * @param x - the transfer engine;
+ * @param latency - the latency in milliseconds.
+ */
+static void aimd_latency(struct xfer *x, long latency)
+{
+	struct aimd *a = &x->aimd;
+
+	if (latency <= 0)
+		return;
+	if (!a->base_latency || latency < a->base_latency) {
+		a->base_latency = latency;
+		return;
+	}
+	if (latency > AIMD_MIN_SPIKE_MS &&
+	    latency * 100 > a->base_latency * AIMD_LATENCY_SPIKE) {
+		aimd_cut(x, "latency spike");
+		return;
+	}
+	/* Let the baseline follow slow changes of the path */
+	a->base_latency += (latency - a->base_latency) / 16;
+}
+
+/**
+ * Account transferred bytes. At the end of each window, increase
+ * the concurrency level by one if the throughput improved since
+ * the last increase and all allowed transfers were running.
+ * Called with the engine lock held.
+ * @param x - the transfer engine;
+ * @param nr_active - the number of running transfers;
+ * @param bytes - the bytes transferred since the last call.
+ */
+static void aimd_update(struct xfer *x, size_t nr_active, uint64_t bytes)
+{
+	struct aimd *a = &x->aimd;
+	int64_t now = get_time_ms();
+	int64_t elapsed = now - a->window_start;
+
+	a->window_bytes += bytes;
+	if (elapsed < AIMD_WINDOW_MS)
+		return;
+
+	a->rate = a->window_bytes * 1000.0 / elapsed;
+	x->stats.throughput = a->rate;
+	if (nr_active >= (size_t)a->level && a->level < a->max &&
+	    a->rate * 100 >= a->prev_rate * (100 + AIMD_MIN_GAIN)) {
+		a->prev_rate = a->rate;
+		a->level++;
+		log_debug("Concurrency increased to %d at %.0f bytes/s\n",
+			  a->level, a->rate);
+	}
+	a->window_start = now;
+	a->window_bytes = 0;
+}
+
+/**
+ * Write a received range to its place in the local file.
+ */
+static size_t xfer_write(void *data, size_t size, size_t nmemb, void *userp)
+{
+	struct xfer_job *job = (struct xfer_job *)userp;
+	size_t len = size * nmemb;
+	char *p = (char *)data;
+	long code = 0;
+
+	curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &code);
+	/* A full response is only usable for a range starting at zero */
+	if ((code != 206 && job->remote_offset + job->done > 0) ||
+	    job->done + len > job->length) {
+		job->bad_range = true;
+		return 0;
+	}
+	/* Sleeping would stall the other transfers of the run */
+	if ((job->chunk.bw_resume = bw_limit_pause(job->chunk.bw, BW_DOWN,
+						   len)))
+		return CURL_WRITEFUNC_PAUSE;
+
+	while (len) {
+		ssize_t n = pwrite(job->fd, p, len,
+				   job->local_offset + job->done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("Could not write to file: %s\n",
+				  strerror(errno));
+			return 0;
+		}
+		p += n;
+		len -= n;
+		job->done += n;
+	}
+	return size * nmemb;
+}
+
+/**
+ * Get the memory the buffers of a job take while it runs.
+ * @param job - the job.
+ * @return the size in bytes.
+ */
+static size_t xfer_buffers(const struct xfer_job *job)
+{
+	if (job->kind == XFER_GET)
+		return http_req_buffers(&job->chunk, false);
+	/* The mapped pages not dropped yet come on top */
+	return http_req_buffers(&job->chunk, true) + UPLOAD_DROP_STEP;
+}
+
+/**
+ * Start a job on the best shard over a pooled connection.
+ * @param c - the cloud descriptor;
+ * @param multi - the multi handle;
+ * @param job - the job;
+ * @param wait - whether to wait for memory of the budget, otherwise
+ * the job is not started while the budget is exhausted.
+ * @return 0 for success, or 1 if the job could not be started.
+ */
+static int xfer_start(struct cld *c, CURLM *multi, struct xfer_job *job,
+		      bool wait)
+{
+	struct shard *sh = shard_select(c->shards, job->kind == XFER_GET
+					? &c->shards->get
+					: &c->shards->upload);
+	CURL *curl;
+	bool adaptive;
+
+	if (!sh) {
+		log_error("No shards to transfer files\n");
+		return 1;
+	}
+	if (!(curl = conn_pool_acquire(c->pool, CONN_BULK))) {
+		shard_end(sh, NULL, SHARD_CANCELLED);
+		return 1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	job->chunk.stall_speed = c->stall_speed;
+	job->chunk.stall_time = c->stall_time;
+	adaptive = c->adaptive_buffers;
+	pthread_mutex_unlock(&c->lock);
+	job->chunk.bw = c->bw;
+	job->chunk.bw_pause = true;
+	job->chunk.bw_resume = 0;
+	if (adaptive)
+		shard_buffer_sizes(sh, &job->chunk.buf_size,
+				   &job->chunk.sock_buf_size);
+	job->reserved = xfer_buffers(job);
+	if (wait) {
+		mem_budget_acquire(c->budget, job->reserved);
+	} else if (!mem_budget_try(c->budget, job->reserved)) {
+		conn_pool_release(c->pool, curl);
+		shard_end(sh, NULL, SHARD_CANCELLED);
+		return 1;
+	}
+	job->curl = curl;
+	job->shard = sh;
+	job->counted = 0;
+	job->bad_range = false;
+	job->resumed_at = job->done;
+
+	if (job->kind == XFER_GET) {
+		struct request *req = cld_req(c);
+
+		request_url(req, sh->url, job->path);
+		curl_easy_reset(curl);
+		http_req_setup(curl, &job->chunk, req->url.buf, NULL);
+		/* Error responses must not get into the file */
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, xfer_write);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, job);
+		snprintf(job->range, sizeof(job->range), "%lld-%lld",
+			 (long long)(job->remote_offset + job->done),
+			 (long long)(job->remote_offset + job->length - 1));
+		curl_easy_setopt(curl, CURLOPT_RANGE, job->range);
+	} else {
+		job->chunk.size = 0;
+		job->upst.addr = job->addr;
+		job->upst.left = job->length;
+		job->upst.base = job->addr;
+		job->upst.dropped = 0;
+		if (upload_req_setup(curl, &job->chunk, sh->url, job->path,
+				     &job->upst, &job->form, NULL)) {
+			mem_budget_release(c->budget, job->reserved);
+			conn_pool_release(c->pool, curl);
+			shard_end(sh, NULL, SHARD_CANCELLED);
+			job->curl = NULL;
+			job->shard = NULL;
+			return 1;
+		}
+	}
+
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, job);
+	curl_multi_add_handle(multi, curl);
+	job->state = XFER_RUNNING;
+	return 0;
+}
+
+/**
+ * Get the number of bytes a running job transferred since
+ * the previous call.
+ * @param job - the job.
+ * @return the number of bytes.
+ */
+static uint64_t xfer_account(struct xfer_job *job)
+{
+	curl_off_t now = 0;
+	uint64_t delta = 0;
+
+	curl_easy_getinfo(job->curl, job->kind == XFER_GET
+			  ? CURLINFO_SIZE_DOWNLOAD_T
+			  : CURLINFO_SIZE_UPLOAD_T, &now);
+	if (now > job->counted) {
+		delta = now - job->counted;
+		job->counted = now;
+	}
+	return delta;
+}
+
+/**
+ * Detach a job from its connection.
+ * @param c - the cloud descriptor;
+ * @param multi - the multi handle;
+ * @param job - the job;
+ * @param res - the transfer result passed to the shard statistics,
+ * SHARD_CANCELLED if the job is cancelled.
+ * @return 1 if the transfer failed because of the shard, otherwise 0.
+ */
+static int xfer_detach(struct cld *c, CURLM *multi, struct xfer_job *job,
+		       int res)
+{
+	int shard_fault;
+
+	curl_multi_remove_handle(multi, job->curl);
+	shard_fault = shard_end(job->shard, job->curl, res);
+	if (job->kind == XFER_PUT)
+		upload_form_cleanup(&job->form);
+	conn_pool_release(c->pool, job->curl);
+	mem_budget_release(c->budget, job->reserved);
+	job->curl = NULL;
+	job->shard = NULL;
+	job->chunk.bw_resume = 0;
+	job->upst.bw_resume = 0;
+	return shard_fault;
+}
+
+/**
+ * Handle a finished attempt of a job: complete the job, put it back
+ * to the queue, or fail it.
+ * @param c - the cloud descriptor;
+ * @param multi - the multi handle;
+ * @param job - the job;
+ * @param result - the transfer result.
+ * @return 0 unless the job failed, XFER_NO_RANGES if the server
+ * does not support ranges, or 1 for other errors.
+ */
+static int xfer_finish(struct cld *c, CURLM *multi, struct xfer_job *job,
+		       CURLcode result)
+{
+	struct xfer *x = c->xfer;
+	curl_off_t pretransfer = 0, starttransfer = 0;
+	bool bad_range = job->bad_range;
+	uint64_t bytes = xfer_account(job);
+	int err, shard_fault;
+	long code;
+
+	pthread_mutex_lock(&x->lock);
+	x->stats.bytes += bytes;
+	pthread_mutex_unlock(&x->lock);
+	err = http_req_result(job->curl, &job->chunk, result);
+	if (!err && job->kind == XFER_GET && job->done != job->length) {
+		log_error("Short response for %s\n", job->path);
+		err = 1;
+	}
+	code = job->chunk.code;
+
+	if (!err && job->kind == XFER_GET) {
+		curl_easy_getinfo(job->curl, CURLINFO_PRETRANSFER_TIME_T,
+				  &pretransfer);
+		curl_easy_getinfo(job->curl, CURLINFO_STARTTRANSFER_TIME_T,
+				  &starttransfer);
+		pthread_mutex_lock(&x->lock);
+		aimd_latency(x, (long)((starttransfer - pretransfer) / 1000));
+		pthread_mutex_unlock(&x->lock);
+	}
+
+	shard_fault = xfer_detach(c, multi, job, err);
+	if (!err) {
+		job->state = XFER_DONE;
+		/* Metadata requests of a job do not wait for the bulk */
+		if (job->on_done && job->on_done(c, job)) {
+			job->state = XFER_FAILED;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (bad_range) {
+		job->state = XFER_FAILED;
+		return XFER_NO_RANGES;
+	}
+
+	if (code == 429 || code >= 500) {
+		pthread_mutex_lock(&x->lock);
+		aimd_cut(x, code == 429 ? "throttled" : "server error");
+		pthread_mutex_unlock(&x->lock);
+	}
+
+	if (code == 429) {
+		if (++job->nr_throttled > XFER_MAX_THROTTLED)
+			goto fail;
+	} else if (!shard_fault) {
+		goto fail;
+	} else if (job->done == job->resumed_at &&
+		   ++job->nr_failures >= SHARD_MAX_ATTEMPTS) {
+		goto fail;
+	}
+
+	/* Progress was made or another shard may do better */
+	log_warn("Transfer of %s failed, retrying\n", job->path);
+	shard_set_invalidate(c->shards);
+	pthread_mutex_lock(&x->lock);
+	x->stats.nr_retries++;
+	pthread_mutex_unlock(&x->lock);
+	job->state = XFER_PENDING;
+	return 0;
+
+fail:
+	log_error("Transfer of %s failed\n", job->path);
+	job->state = XFER_FAILED;
+	return 1;
+}
+
+/**
+ * Choose the next job to start. The flow with the fewest running
+ * jobs goes first, so that the files of a batch share the transfers
+ * fairly, and of those the flow with the fewest bytes left, so that
+ * small files complete early.
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs;
+ * @param flows - the flow tallies;
+ * @return the job, or NULL if no job is pending.
+ */
+static struct xfer_job *xfer_next(struct xfer_job *jobs, size_t nr_jobs,
+				  const struct xfer_flow *flows)
+{
+	struct xfer_job *best = NULL;
+	size_t i;
+
+	for (i = 0; i < nr_jobs; i++) {
+		const struct xfer_flow *f = &flows[jobs[i].flow];
+
+		if (jobs[i].state != XFER_PENDING)
+			continue;
+		if (!best || f->running < flows[best->flow].running ||
+		    (f->running == flows[best->flow].running &&
+		     f->left < flows[best->flow].left))
+			best = &jobs[i];
+	}
+	return best;
+}
+
+/**
+ * Count the running jobs and the bytes left of each flow.
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs;
+ * @param flows - the flow tallies to fill in;
+ * @param nr_flows - the number of flows.
+ */
+static void xfer_tally(const struct xfer_job *jobs, size_t nr_jobs,
+		       struct xfer_flow *flows, size_t nr_flows)
+{
+	size_t i;
+
+	memset(flows, 0, nr_flows * sizeof(*flows));
+	for (i = 0; i < nr_jobs; i++) {
+		struct xfer_flow *f = &flows[jobs[i].flow];
+
+		if (jobs[i].state == XFER_RUNNING)
+			f->running++;
+		if (jobs[i].state == XFER_PENDING ||
+		    jobs[i].state == XFER_RUNNING)
+			f->left += jobs[i].length - jobs[i].done;
+	}
+}
+
+/**
+ * Show the aggregate progress of the uploads.
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs;
+ * @param last - the time of the last output, updated.
+ */
+static void xfer_progress(struct xfer_job *jobs, size_t nr_jobs,
+			  time_t *last)
+{
+	uint64_t total = 0, sent = 0;
+	time_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (jobs[i].kind != XFER_PUT || !jobs[i].chunk.show_progress)
+			continue;
+		total += jobs[i].length;
+		if (jobs[i].state == XFER_DONE)
+			sent += jobs[i].length;
+		else if (jobs[i].curl)
+			sent += jobs[i].counted;
+	}
+	if (!total || (now == *last && sent < total))
+		return;
+	*last = now;
+	log_error("\r%3d%% uploaded...", (int)(sent * 100 / total));
+	if (sent == total)
+		log_error("\n\n");
+}
+
+/**
+ * Resume the transfers paused by the bandwidth limit whose time
+ * has come.
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs.
+ * @return the time in ms until the next transfer is to be resumed,
+ * or the default poll timeout if none is paused.
+ */
+static long xfer_resume(struct xfer_job *jobs, size_t nr_jobs)
+{
+	int64_t now = get_time_ms(), next = now + XFER_POLL_MS;
+	size_t i;
+
+	for (i = 0; i < nr_jobs; i++) {
+		struct xfer_job *job = &jobs[i];
+		int64_t resume = job->chunk.bw_resume;
+
+		if (!job->curl)
+			continue;
+		/* An upload waits for the data to send, its reply too */
+		if (job->upst.bw_resume > resume)
+			resume = job->upst.bw_resume;
+		if (!resume)
+			continue;
+		if (resume > now) {
+			if (resume < next)
+				next = resume;
+			continue;
+		}
+		job->chunk.bw_resume = 0;
+		job->upst.bw_resume = 0;
+		/* The callbacks pause it again if the limit is still hit */
+		curl_easy_pause(job->curl, CURLPAUSE_CONT);
+	}
+	return (long)(next - now);
+}
+
+/**
+ * Run the jobs in parallel. The number of jobs running at once
+ * is chosen by the concurrency controller of the session.
+ * The shard info must be fetched before.
+ * @param c - the cloud descriptor;
+ * @param jobs - the jobs;
+ * @param nr_jobs - the number of jobs.
+ * @return 0 for success, XFER_NO_RANGES if the server does not
+ * support ranged downloads, or 1 for other errors.
+ */
+int xfer_run(struct cld *c, struct xfer_job *jobs, size_t nr_jobs)
+{
+	struct xfer *x = c->xfer;
+	struct xfer_flow *flows;
+	CURLM *multi;
+	size_t i, nr_flows = 0, nr_active = 0, nr_left = nr_jobs;
+	time_t last_progress = 0;
+	long timeout_ms;
+	int res = 0, level;
+
+	if (!nr_jobs)
+		return 0;
+
+	/* The runs of other threads would break the measurements */
+	pthread_mutex_lock(&x->run_lock);
+	/* The connections of the multi handle are reused by later runs */
+	if (!x->multi && !(x->multi = curl_multi_init())) {
+		log_error("curl_multi_init() failed\n");
+		pthread_mutex_unlock(&x->run_lock);
+		return 1;
+	}
+	multi = x->multi;
+	for (i = 0; i < nr_jobs; i++)
+		if ((size_t)jobs[i].flow >= nr_flows)
+			nr_flows = jobs[i].flow + 1;
+	flows = xcalloc(nr_flows, sizeof(*flows));
+	pthread_mutex_lock(&x->lock);
+	x->aimd.window_start = get_time_ms();
+	x->aimd.window_bytes = 0;
+	level = x->aimd.level;
+	pthread_mutex_unlock(&x->lock);
+
+	while (nr_left && !res) {
+		CURLMsg *msg;
+		int running = 0, nr_msgs;
+		uint64_t bytes = 0;
+
+		xfer_tally(jobs, nr_jobs, flows, nr_flows);
+		while (nr_active < (size_t)level) {
+			struct xfer_job *job = xfer_next(jobs, nr_jobs, flows);
+
+			/* Only the first transfer waits for memory */
+			if (!job || xfer_start(c, multi, job, !nr_active))
+				break;
+			flows[job->flow].running++;
+			nr_active++;
+		}
+		if (!nr_active) {
+			log_error("Could not start a transfer\n");
+			res = 1;
+			break;
+		}
+
+		if (curl_multi_perform(multi, &running) != CURLM_OK) {
+			log_error("curl_multi_perform failed\n");
+			res = 1;
+			break;
+		}
+
+		while ((msg = curl_multi_info_read(multi, &nr_msgs))) {
+			void *job;
+			int status;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+					  &job);
+			nr_active--;
+			status = xfer_finish(c, multi, (struct xfer_job *)job,
+					     msg->data.result);
+			if (((struct xfer_job *)job)->state != XFER_PENDING)
+				nr_left--;
+			if (status && !res)
+				res = status;
+		}
+
+		for (i = 0; i < nr_jobs; i++)
+			if (jobs[i].curl)
+				bytes += xfer_account(&jobs[i]);
+		pthread_mutex_lock(&x->lock);
+		x->stats.bytes += bytes;
+		aimd_update(x, nr_active, bytes);
+		level = x->aimd.level;
+		pthread_mutex_unlock(&x->lock);
+		xfer_progress(jobs, nr_jobs, &last_progress);
+		timeout_ms = xfer_resume(jobs, nr_jobs);
+
+		if (!res && running)
+			curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+	}
+
+	/* Cancel the transfers still running after a failure */
+	for (i = 0; i < nr_jobs; i++) {
+		if (!jobs[i].curl)
+			continue;
+		/* Cancelling says nothing about the shard */
+		xfer_detach(c, multi, &jobs[i], SHARD_CANCELLED);
+		jobs[i].state = XFER_FAILED;
+	}
+	free(flows);
+
+	pthread_mutex_lock(&x->lock);
+	x->stats.concurrency = x->aimd.level;
+	x->stats.max_concurrency = x->aimd.max;
+	log_debug("Transferred %llu bytes in total, concurrency %d\n",
+		  (unsigned long long)x->stats.bytes, x->aimd.level);
+	pthread_mutex_unlock(&x->lock);
+	pthread_mutex_unlock(&x->run_lock);
+	return res;
+}
+
+/**
+ * Set the upper bound of the number of parallel transfers.
+ * The default memory budget follows it, see mem_budget_default().
+ * @param c - the cloud descriptor;
+ * @param max - the upper bound, 1 to CONN_POOL_MAX_BULK.
+ * @return 0 for success, or 1 for a wrong value.
+ */
+int cld_set_max_concurrency(struct cld *c, int max)
+{
+	if (max < 1 || max > CONN_POOL_MAX_BULK) {
+		log_error("The concurrency must be 1 to %d\n",
+			  CONN_POOL_MAX_BULK);
+		return 1;
+	}
+	pthread_mutex_lock(&c->xfer->lock);
+	c->xfer->aimd.max = max;
+	if (c->xfer->aimd.level > max)
+		c->xfer->aimd.level = max;
+	c->xfer->stats.max_concurrency = max;
+	pthread_mutex_unlock(&c->xfer->lock);
+	mem_budget_set_default(c->budget, mem_budget_default(max));
+	return 0;
+}
+
+/**
+ * Get the statistics of the file transfers of the session.
+ * @param c - the cloud descriptor;
+ * @param stats - the structure receiving the statistics.
+ */
+void cld_get_stats(struct cld *c, struct transfer_stats *stats)
+{
+	pthread_mutex_lock(&c->xfer->lock);
+	*stats = c->xfer->stats;
+	stats->concurrency = c->xfer->aimd.level;
+	stats->max_concurrency = c->xfer->aimd.max;
+	pthread_mutex_unlock(&c->xfer->lock);
+	stats->peak_memory = mem_budget_peak(c->budget);
+}
@@ -8,17 +8,24 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <claud/utils.h>
 #include <claud/types.h>
 #include <claud/http_api.h>
 
 /**
  * Maximum log level of messages to be shown.
+ * Accessed atomically, as any thread may log.
  */
 static int log_level = LOG_ERROR;
 
 static FILE *log_fp = NULL;
 
+/** Keeps the messages of different threads from interleaving */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
 
 /**
@@ -27,7 +34,9 @@ static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
  */
 void init_log(FILE *fp)
 {
+	pthread_mutex_lock(&log_lock);
 	log_fp = fp;
+	pthread_mutex_unlock(&log_lock);
 }
 
 /**
@@ -45,10 +54,8 @@ void log_message(int level, const char *file, int line, const char *fmt, ...)
 	char *p, *np;
 	va_list ap;
 	
-	if (!log_fp)
-		return;
-
-	if (log_level < level || level > LOG_DEBUG || level < LOG_ERROR)
+	if (__atomic_load_n(&log_level, __ATOMIC_RELAXED) < level ||
+	    level > LOG_DEBUG || level < LOG_ERROR)
 		return;
 	
 	if ((p = malloc(size)) == NULL)
@@ -61,8 +68,10 @@ void log_message(int level, const char *file, int line, const char *fmt, ...)
 		va_end(ap);
 
 		/* Check error code */
-		if (n < 0)
+		if (n < 0) {
+			free(p);
 			return;
+		}
 
 		/* If that worked, fine */
 		if (n < size)
@@ -78,7 +87,11 @@ void log_message(int level, const char *file, int line, const char *fmt, ...)
 		}
 	}
 
-	fprintf(log_fp, "%s [%s:%d] %s", level_names[level], file, line, p);
+	pthread_mutex_lock(&log_lock);
+	if (log_fp)
+		fprintf(log_fp, "%s [%s:%d] %s", level_names[level], file,
+			line, p);
+	pthread_mutex_unlock(&log_lock);
 	free(p);
 }
 
@@ -91,7 +104,7 @@ void set_log_level(int val)
 {
 	if (val < LOG_ERROR || val > LOG_DEBUG)
 		return;
-	log_level = val;
+	__atomic_store_n(&log_level, val, __ATOMIC_RELAXED);
 }
 
 /**
@@ -100,7 +113,7 @@ void set_log_level(int val)
  */
 int get_log_level()
 {
-	return log_level;
+	return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
 }
 
 /**
@@ -195,9 +208,11 @@ char *extend_dirname(const char *dirname, struct file_list *contents)
 	struct list_item *list = contents->body.list;
 	size_t nr_items = contents->body.nr_list_items;
 
-	for (; i < nr_items; i++)
-		if (filename_len < strlen(list[i].name))
-			filename_len = strlen(list[i].name);
+	for (; i < nr_items; i++) {
+		const char *name = list_item_name(contents, &list[i]);
+		if (name && filename_len < strlen(name))
+			filename_len = strlen(name);
+	}
 		
 	if (dirname[dirname_len - 1] == '/')
 		dirname_len -= 1;
@@ -209,9 +224,30 @@ char *extend_dirname(const char *dirname, struct file_list *contents)
 	return full_path;
 }
 
+/** Random generator state of the thread, seeded on the first use */
+static __thread unsigned int random_seed;
+static __thread bool random_seeded;
+
+static void seed_random(void)
+{
+	FILE *f = fopen("/dev/urandom", "r");
+
+	if (!f || fread(&random_seed, sizeof(random_seed), 1, f) != 1) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		/* The address differs between threads */
+		random_seed = (unsigned int)ts.tv_nsec ^
+			(unsigned int)(uintptr_t)&random_seed;
+	}
+	if (f)
+		fclose(f);
+	random_seeded = true;
+}
+
 /**
  * Fill the string of a specified length with random
- * alphanumeric data.
+ * alphanumeric data. Each thread uses its own generator,
+ * so that threads and processes get different strings.
  * @param s - the pointer to the string;
  * @param len - the length of the string.
  */
@@ -222,12 +258,79 @@ void fill_random(char *s, const size_t len) {
 		"abcdefghijklmnopqrstuvwxyz";
 	size_t i = 0;
 
+	if (!random_seeded)
+		seed_random();
 	for (; i < len - 1; i++)
-		s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+		s[i] = alphanum[rand_r(&random_seed) % (sizeof(alphanum) - 1)];
 
 	s[len - 1] = 0;
 }
 
+/** Initial size of a string buffer */
+#define STRBUF_INIT_SIZE 256
+
+/**
+ * Initialize a string buffer with an empty string.
+ * @param sb - the buffer.
+ */
+void strbuf_init(struct strbuf *sb)
+{
+	sb->size = STRBUF_INIT_SIZE;
+	sb->buf = xmalloc(sb->size);
+	strbuf_reset(sb);
+}
+
+/**
+ * Free the memory of a string buffer.
+ * @param sb - the buffer.
+ */
+void strbuf_cleanup(struct strbuf *sb)
+{
+	free(sb->buf);
+	memset(sb, 0, sizeof(*sb));
+}
+
+/**
+ * Make sure that the buffer can take more characters without
+ * reallocation.
+ * @param sb - the buffer;
+ * @param extra - the number of characters to be appended.
+ */
+void strbuf_reserve(struct strbuf *sb, size_t extra)
+{
+	size_t need = sb->len + extra + 1;
+	if (need <= sb->size)
+		return;
+	while (sb->size < need)
+		sb->size *= 2;
+	sb->buf = xrealloc(sb->buf, sb->size);
+}
+
+/**
+ * Append data to the buffer.
+ * @param sb - the buffer;
+ * @param data - the data to append;
+ * @param len - the data length.
+ */
+void strbuf_append(struct strbuf *sb, const char *data, size_t len)
+{
+	strbuf_reserve(sb, len);
+	memcpy(sb->buf + sb->len, data, len);
+	sb->len += len;
+	sb->buf[sb->len] = '\0';
+}
+
+/**
+ * Get the current value of the monotonic clock.
+ * @return the time in milliseconds.
+ */
+int64_t get_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * Create a file part name out of file name and part index.
  * @param name - the file name;
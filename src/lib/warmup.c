@@ -0,0 +1,386 @@
+/**
+ * @file warmup.c
+ * Session warm-up for Mail.Ru Cloud access library.
+ *
+ * Name resolution and TLS handshakes to the hosts of a session are
+ * made in a background thread while the session authenticates or runs
+ * metadata requests. The DNS entries and TLS sessions end up in
+ * the data shared by the pool, so the first transfer to a shard host
+ * skips the lookup and resumes the TLS session. No request is sent
+ * over the warm-up connections: they only live in the multi handle
+ * of the thread and are closed with it. The thread is cancelled when
+ * the session ends before it is done.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+#include <claud/conn_pool.h>
+#include <claud/shards.h>
+#include <claud/warmup.h>
+#include <claud/utils.h>
+
+void warmup_init(struct warmup *w, struct conn_pool *pool)
+{
+	memset(w, 0, sizeof(*w));
+	w->pool = pool;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->fetched_cond, NULL);
+	request_init(&w->req);
+}
+
+/**
+ * Forget the hosts and the token of the previous warm-up.
+ * @param w - the warm-up descriptor.
+ */
+static void warmup_reset(struct warmup *w)
+{
+	size_t i;
+
+	warmup_wait(w);
+	for (i = 0; i < w->nr_urls; i++)
+		free(w->urls[i]);
+	memset(w->rtt_us, 0, sizeof(w->rtt_us));
+	w->nr_urls = 0;
+	w->set = NULL;
+	free(w->token);
+	w->token = NULL;
+}
+
+void warmup_cleanup(struct warmup *w)
+{
+	warmup_reset(w);
+	shard_info_cleanup(&w->shards);
+	request_cleanup(&w->req);
+	pthread_cond_destroy(&w->fetched_cond);
+	pthread_mutex_destroy(&w->lock);
+	memset(w, 0, sizeof(*w));
+}
+
+/**
+ * Add the root URL of the host of the specified URL to the list
+ * of URLs to connect, unless it is already there.
+ * The caller holds the lock of the warm-up, unless the thread
+ * is not running.
+ * @param w - the warm-up descriptor;
+ * @param url - the URL.
+ */
+static void add_host_url(struct warmup *w, const char *url)
+{
+	const char *host = strstr(url, "://");
+	const char *path;
+	size_t i, len;
+
+	if (!host || w->nr_urls == WARMUP_MAX_HOSTS)
+		return;
+	path = strchr(host + 3, '/');
+	len = path ? (size_t)(path - url) : strlen(url);
+
+	for (i = 0; i < w->nr_urls; i++)
+		if (!strncmp(w->urls[i], url, len) && w->urls[i][len] == '/')
+			return;
+
+	w->rtt_us[w->nr_urls] = 0;
+	w->urls[w->nr_urls] = xmalloc(len + 2);
+	memcpy(w->urls[w->nr_urls], url, len);
+	strcpy(w->urls[w->nr_urls] + len, "/");
+	w->nr_urls++;
+}
+
+static bool warmup_cancelled(struct warmup *w)
+{
+	return __atomic_load_n(&w->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Run the requests added to the multi handle until they are done,
+ * or until the warm-up is cancelled.
+ * @param w - the warm-up descriptor;
+ * @param on_done - called with each finished request;
+ * @param arg - the callback argument.
+ */
+static void warmup_perform(struct warmup *w,
+			   void (*on_done)(CURLMsg *msg, void *arg),
+			   void *arg)
+{
+	CURLMsg *msg;
+	int running, nr_msgs;
+
+	do {
+		if (warmup_cancelled(w) ||
+		    curl_multi_perform(w->multi, &running) != CURLM_OK)
+			break;
+		while ((msg = curl_multi_info_read(w->multi, &nr_msgs)))
+			if (msg->msg == CURLMSG_DONE)
+				on_done(msg, arg);
+		/* Woken up early by warmup_cancel() */
+		if (running)
+			curl_multi_poll(w->multi, NULL, 0, 1000, NULL);
+	} while (running);
+}
+
+static void shards_done(CURLMsg *msg, void *arg)
+{
+	*(CURLcode *)arg = msg->data.result;
+}
+
+/**
+ * Request the shards from the dispatcher and add their hosts to
+ * the hosts to connect. Whoever waits for the shards in
+ * warmup_take_shards() is woken up as soon as the response arrives.
+ * @param w - the warm-up descriptor.
+ */
+static void fetch_shards(struct warmup *w)
+{
+	CURL *curl = w->handles[0];
+	CURLcode res = CURLE_ABORTED_BY_CALLBACK;
+	struct memory_struct chunk;
+	bool have_shards = false;
+	size_t i;
+
+	if (shard_info_request(&w->req, w->token))
+		goto out_signal;
+
+	memory_struct_init(&chunk);
+	chunk.compressed = true;
+	curl_easy_reset(curl);
+	http_req_setup(curl, &chunk, w->req.url.buf, NULL);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, WARMUP_TIMEOUT_MS);
+	curl_multi_add_handle(w->multi, curl);
+	warmup_perform(w, shards_done, &res);
+	curl_multi_remove_handle(w->multi, curl);
+
+	if (!warmup_cancelled(w) && !http_req_result(curl, &chunk, res) &&
+	    !shard_info_parse(&chunk, &w->shards))
+		have_shards = true;
+	memory_struct_cleanup(&chunk);
+
+out_signal:
+	pthread_mutex_lock(&w->lock);
+	if (have_shards) {
+		for (i = 0; i < w->shards.body.get.size; i++)
+			add_host_url(w, w->shards.body.get.items[i].url);
+		for (i = 0; i < w->shards.body.upload.size; i++)
+			add_host_url(w, w->shards.body.upload.items[i].url);
+	}
+	w->have_shards = have_shards;
+	w->fetched = true;
+	pthread_cond_broadcast(&w->fetched_cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Account the round-trip time measured to a host. It goes to
+ * the shard set right away if the set knows the shards already,
+ * otherwise warmup_report_probes() passes it on later.
+ * @param w - the warm-up descriptor;
+ * @param i - the index of the host;
+ * @param rtt_us - the round-trip time.
+ */
+static void host_probed(struct warmup *w, size_t i, long rtt_us)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->set)
+		shard_set_probe(w->set, w->urls[i], rtt_us);
+	else
+		w->rtt_us[i] = rtt_us;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void host_done(CURLMsg *msg, void *arg)
+{
+	struct warmup *w = (struct warmup *)arg;
+	size_t i;
+	curl_off_t lookup = 0, connect = 0;
+
+	for (i = 0; i < w->nr_handles; i++)
+		if (w->handles[i] == msg->easy_handle)
+			break;
+	curl_easy_getinfo(msg->easy_handle,
+			  CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+	curl_easy_getinfo(msg->easy_handle,
+			  CURLINFO_CONNECT_TIME_T, &connect);
+	/* The TCP handshake takes one round trip */
+	if (i < w->nr_handles && msg->data.result == CURLE_OK &&
+	    connect > lookup)
+		host_probed(w, i, (long)(connect - lookup));
+	log_debug("Warm-up connection: %s, %ld us\n",
+		  curl_easy_strerror(msg->data.result), (long)connect);
+}
+
+/**
+ * Connect to all listed hosts in parallel. Only the connection
+ * and the TLS handshake are made, no request is sent.
+ * @param w - the warm-up descriptor.
+ */
+static void connect_hosts(struct warmup *w)
+{
+	size_t i, n = w->nr_urls < w->nr_handles ? w->nr_urls : w->nr_handles;
+
+	for (i = 0; i < n; i++) {
+		CURL *curl = w->handles[i];
+		curl_easy_reset(curl);
+		curl_easy_setopt(curl, CURLOPT_URL, w->urls[i]);
+		curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, WARMUP_TIMEOUT_MS);
+		curl_multi_add_handle(w->multi, curl);
+	}
+
+	warmup_perform(w, host_done, w);
+
+	for (i = 0; i < n; i++)
+		curl_multi_remove_handle(w->multi, w->handles[i]);
+}
+
+static void *warmup_thread(void *arg)
+{
+	struct warmup *w = (struct warmup *)arg;
+
+	if (w->token)
+		fetch_shards(w);
+	connect_hosts(w);
+	return NULL;
+}
+
+/**
+ * Start the warm-up thread. If the token is specified, the shards are
+ * requested from the dispatcher first and their hosts are connected too.
+ * @param w - the warm-up descriptor;
+ * @param urls - URLs of the hosts to connect;
+ * @param nr_urls - the number of URLs;
+ * @param token - the authentication token, or NULL.
+ * @return 0 for success, or 1 if the thread could not be started.
+ */
+int warmup_start(struct warmup *w, const char *urls[], size_t nr_urls,
+		 const char *token)
+{
+	size_t i;
+
+	warmup_reset(w);
+	shard_info_cleanup(&w->shards);
+	w->have_shards = false;
+	w->fetched = false;
+
+	for (i = 0; i < nr_urls; i++)
+		add_host_url(w, urls[i]);
+	if (token)
+		w->token = xstrdup(token);
+
+	for (i = 0; i < WARMUP_MAX_HOSTS; i++) {
+		w->handles[i] = conn_pool_acquire(w->pool, CONN_METADATA);
+		if (!w->handles[i])
+			break;
+		w->nr_handles++;
+	}
+
+	w->cancelled = false;
+	if (!w->nr_handles || !(w->multi = curl_multi_init()) ||
+	    pthread_create(&w->thread, NULL, warmup_thread, w)) {
+		log_warn("Could not start session warm-up\n");
+		warmup_wait(w);
+		return 1;
+	}
+	w->running = true;
+	return 0;
+}
+
+/**
+ * Wait for the warm-up thread to finish and return its handles
+ * to the pool.
+ * @param w - the warm-up descriptor.
+ */
+void warmup_wait(struct warmup *w)
+{
+	size_t i;
+
+	if (w->running) {
+		pthread_join(w->thread, NULL);
+		w->running = false;
+	}
+	if (w->multi) {
+		curl_multi_cleanup(w->multi);
+		w->multi = NULL;
+	}
+	for (i = 0; i < w->nr_handles; i++)
+		conn_pool_release(w->pool, w->handles[i]);
+	w->nr_handles = 0;
+}
+
+/**
+ * Make the warm-up thread stop as soon as possible, e.g. when
+ * the session ends before it has any use for the warm connections.
+ * The thread still has to be waited for with warmup_wait().
+ * @param w - the warm-up descriptor.
+ */
+void warmup_cancel(struct warmup *w)
+{
+	if (!w->running)
+		return;
+	__atomic_store_n(&w->cancelled, true, __ATOMIC_RELEASE);
+	curl_multi_wakeup(w->multi);
+}
+
+/**
+ * Take over the shards fetched by the warm-up thread. If the thread
+ * is still waiting for the dispatcher, wait for the response only,
+ * not for the connections to the hosts.
+ * @param w - the warm-up descriptor;
+ * @param s - the shard info structure receiving the shards.
+ * @return 0 if the shards were taken, or 1 if there are none.
+ */
+int warmup_take_shards(struct warmup *w, struct shard_info *s)
+{
+	int res = 1;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->running && w->token && !w->fetched)
+		pthread_cond_wait(&w->fetched_cond, &w->lock);
+	if (w->have_shards) {
+		*s = w->shards;
+		memset(&w->shards, 0, sizeof(w->shards));
+		w->have_shards = false;
+		res = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return res;
+}
+
+/**
+ * Pass the round-trip times measured so far while connecting to
+ * the hosts to the shard set. The times measured later are passed
+ * by the warm-up thread itself.
+ * @param w - the warm-up descriptor;
+ * @param set - the shard set.
+ */
+void warmup_report_probes(struct warmup *w, struct shard_set *set)
+{
+	size_t i;
+
+	pthread_mutex_lock(&w->lock);
+	w->set = set;
+	for (i = 0; i < w->nr_urls; i++) {
+		shard_set_probe(set, w->urls[i], w->rtt_us[i]);
+		w->rtt_us[i] = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
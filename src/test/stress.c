@@ -0,0 +1,384 @@
+/**
+ * @file stress.c
+ * Multithreaded stress test of Mail.Ru Cloud access library.
+ *
+ * Several threads list a directory, get file info, fetch the shards,
+ * log and change the settings of one session at once. The library
+ * is built with CLOUD_ENDPOINT pointing to the server run by the test,
+ * and the test is meant to run under ThreadSanitizer, see the tsan
+ * target of the Makefile.
+ *
+ * Copyright (C) 2019 Nikolai Kopanygin <nikolai.kopanygin@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <claud/types.h>
+#include <claud/http_api.h>
+#include <claud/cld.h>
+#include <claud/utils.h>
+
+#define NR_THREADS 8
+#define NR_ITERATIONS 20
+/** More than a listing page, so that the listing takes several */
+#define NR_ENTRIES 1200
+#define USER "stress"
+#define DOMAIN "localhost"
+/** The token cached before the test, the server rejects it */
+#define STALE_TOKEN "stale"
+/** The token the server hands out and accepts */
+#define FRESH_TOKEN "fresh"
+
+static int listen_fd = -1;
+static int nr_errors;
+
+static void fail(const char *what)
+{
+	log_error("%s failed\n", what);
+	__atomic_add_fetch(&nr_errors, 1, __ATOMIC_RELAXED);
+}
+
+static void append_printf(struct strbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	strbuf_reserve(sb, len);
+	va_start(ap, fmt);
+	vsnprintf(sb->buf + sb->len, len + 1, fmt, ap);
+	va_end(ap);
+	sb->len += len;
+}
+
+/**
+ * Find a query parameter of the request path.
+ * @param path - the request path;
+ * @param name - the parameter name.
+ * @return the value, or NULL if the parameter is not there.
+ */
+static const char *query_param(const char *path, const char *name)
+{
+	const char *p = strchr(path, '?');
+	size_t len = strlen(name);
+
+	while (p) {
+		p++;
+		if (!strncmp(p, name, len) && p[len] == '=')
+			return p + len + 1;
+		p = strchr(p, '&');
+	}
+	return NULL;
+}
+
+static bool is_call(const char *path, const char *call)
+{
+	size_t len = strlen(call);
+	return !strncmp(path, "/api/v2/", 8) && !strncmp(path + 8, call, len) &&
+		(path[8 + len] == '?' || path[8 + len] == '\0');
+}
+
+/**
+ * Build the response body to a cloud API request.
+ * @param path - the request path;
+ * @param body - the buffer receiving the body.
+ * @return the HTTP status code.
+ */
+static int api_response(const char *path, struct strbuf *body)
+{
+	const char *token = query_param(path, "token");
+	const char *arg;
+	long offset = 0, limit = NR_ENTRIES, i;
+
+	if (is_call(path, "tokens/csrf")) {
+		append_printf(body, "{\"body\":{\"token\":\"%s\"}}",
+			      FRESH_TOKEN);
+		return 200;
+	}
+	if (!token || strncmp(token, FRESH_TOKEN, strlen(FRESH_TOKEN)))
+		return 403;
+
+	if (is_call(path, "dispatcher")) {
+		append_printf(body, "{\"email\":\"%s@%s\",\"status\":200,"
+			      "\"body\":{\"get\":[{\"count\":\"1\","
+			      "\"url\":\"%sget/\"}],\"upload\":[{\"count\":"
+			      "\"1\",\"url\":\"%supload/\"}]}}",
+			      USER, DOMAIN, CLOUD_ENDPOINT, CLOUD_ENDPOINT);
+	} else if (is_call(path, "file")) {
+		append_printf(body, "{\"status\":200,\"body\":{\"name\":"
+			      "\"f0000.txt\",\"kind\":\"file\",\"type\":"
+			      "\"file\",\"size\":1,\"hash\":\"H0000\","
+			      "\"mtime\":1560000000}}");
+	} else if (is_call(path, "folder")) {
+		if ((arg = query_param(path, "offset")))
+			offset = atol(arg);
+		if ((arg = query_param(path, "limit")))
+			limit = atol(arg);
+		append_printf(body, "{\"status\":200,\"body\":{\"count\":"
+			      "{\"folders\":0,\"files\":%d},\"list\":[",
+			      NR_ENTRIES);
+		for (i = offset; i < NR_ENTRIES && i < offset + limit; i++)
+			append_printf(body, "%s{\"name\":\"f%04ld.txt\","
+				      "\"kind\":\"file\",\"type\":\"file\","
+				      "\"size\":1,\"hash\":\"H%04ld\","
+				      "\"mtime\":1560000000}",
+				      i > offset ? "," : "", i, i);
+		append_printf(body, "]}}");
+	} else {
+		return 404;
+	}
+	return 200;
+}
+
+/**
+ * Answer the requests of a connection until the client closes it.
+ * @param arg - the connection socket.
+ */
+static void *serve_connection(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buf[8192], path[4096];
+	size_t len = 0;
+	ssize_t n;
+	char *end;
+
+	while ((n = read(fd, buf + len, sizeof(buf) - len - 1)) > 0) {
+		len += n;
+		buf[len] = '\0';
+		while ((end = strstr(buf, "\r\n\r\n"))) {
+			struct strbuf body, head;
+			int code = 400;
+
+			strbuf_init(&body);
+			strbuf_init(&head);
+			if (sscanf(buf, "GET %4095s", path) == 1)
+				code = api_response(path, &body);
+			append_printf(&head, "HTTP/1.1 %d X\r\n"
+				      "Content-Type: application/json\r\n"
+				      "Content-Length: %zu\r\n\r\n",
+				      code, body.len);
+			if (write(fd, head.buf, head.len) < 0 ||
+			    write(fd, body.buf, body.len) < 0)
+				len = 0;
+			strbuf_cleanup(&head);
+			strbuf_cleanup(&body);
+
+			/* GET requests have no body */
+			end += 4;
+			len -= end - buf;
+			memmove(buf, end, len + 1);
+		}
+		if (len == sizeof(buf) - 1)
+			break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *serve(void *arg)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int fd;
+
+	(void)arg;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+		if (pthread_create(&thread, &attr, serve_connection,
+				   (void *)(intptr_t)fd))
+			close(fd);
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+/**
+ * Listen on the port of CLOUD_ENDPOINT.
+ * @param thread - the server thread to start.
+ * @return 0 for success, or 1 for error.
+ */
+static int server_start(pthread_t *thread)
+{
+	struct sockaddr_in addr;
+	int port, one = 1;
+
+	if (sscanf(CLOUD_ENDPOINT, "http://127.0.0.1:%d/", &port) != 1) {
+		log_error("The library is not built for the test, "
+			  "CLOUD_ENDPOINT is %s\n", CLOUD_ENDPOINT);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+		       sizeof(one)) ||
+	    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, 64) ||
+	    pthread_create(thread, NULL, serve, NULL)) {
+		log_error("Could not listen on port %d: %s\n", port,
+			  strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static void server_stop(pthread_t thread)
+{
+	shutdown(listen_fd, SHUT_RDWR);
+	pthread_join(thread, NULL);
+	close(listen_fd);
+}
+
+/**
+ * Cache a session with a token the server rejects, so that the threads
+ * renew it at once when they start.
+ * @return 0 for success, or 1 for error.
+ */
+static int cache_session(void)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	char path[4096];
+	FILE *f;
+
+	if (!dir) {
+		log_error("XDG_CACHE_HOME is not set\n");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/claud", dir);
+	mkdir(dir, 0700);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/claud/%s@%s.token", dir, USER,
+		 DOMAIN);
+	if (!(f = fopen(path, "w"))) {
+		log_error("Could not write %s\n", path);
+		return 1;
+	}
+	fprintf(f, "%s\n", STALE_TOKEN);
+	fclose(f);
+	return 0;
+}
+
+static int count_entry(void *arg, const struct file_list *finfo,
+		       const struct list_item *li)
+{
+	(void)finfo;
+	(void)li;
+	(*(size_t *)arg)++;
+	return 0;
+}
+
+static void *stress_thread(void *arg)
+{
+	struct cld *c = arg;
+	struct file_list finfo;
+	size_t nr_entries;
+	int i;
+
+	for (i = 0; i < NR_ITERATIONS; i++) {
+		log_info("Iteration %d\n", i);
+		if (cld_get_shard_info(c))
+			fail("cld_get_shard_info()");
+
+		memset(&finfo, 0, sizeof(finfo));
+		if (cld_file_stat(c, "/f0000.txt", &finfo) ||
+		    finfo.body.size != 1)
+			fail("cld_file_stat()");
+		cld_file_list_cleanup(&finfo);
+
+		memset(&finfo, 0, sizeof(finfo));
+		if (cld_get_file_list(c, "/", &finfo, false) ||
+		    finfo.body.nr_list_items != NR_ENTRIES)
+			fail("cld_get_file_list()");
+		cld_file_list_cleanup(&finfo);
+
+		nr_entries = 0;
+		if (cld_iterate_file_list(c, "/", true, count_entry,
+					  &nr_entries) ||
+		    nr_entries != NR_ENTRIES)
+			fail("cld_iterate_file_list()");
+
+		/* The settings may change while other threads use them */
+		set_log_level(i % 2 ? LOG_DEBUG : LOG_INFO);
+		cld_set_hedging(c, i % 2, 0, 0);
+		cld_set_adaptive_buffers(c, i % 2);
+		cld_set_stall_limits(c, 1024 + i, 30);
+	}
+	cld_thread_release(c);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t server, threads[NR_THREADS];
+	FILE *log = stderr;
+	struct cld *c;
+	int error, i;
+
+	/* The debug messages of the library may go to a file */
+	if (argc > 1 && !(log = fopen(argv[1], "w"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	init_log(log);
+	set_log_level(LOG_INFO);
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	if (cache_session() || server_start(&server))
+		return 1;
+
+	if (!(c = new_cloud(USER, NULL, DOMAIN, &error))) {
+		log_error("new_cloud() failed\n");
+		return 1;
+	}
+	for (i = 0; i < NR_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, stress_thread, c)) {
+			log_error("pthread_create() failed\n");
+			return 1;
+		}
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	delete_cloud(c);
+
+	server_stop(server);
+	curl_global_cleanup();
+	if (log != stderr)
+		fclose(log);
+	if (nr_errors) {
+		fprintf(stderr, "%d calls failed\n", nr_errors);
+		return 1;
+	}
+	printf("%d threads made %d iterations each\n", NR_THREADS,
+	       NR_ITERATIONS);
+	return 0;
+}